@@ -0,0 +1,274 @@
+/* See LICENSE for license details. */
+
+/*
+ * Headless benchmark of the parser and the screen model.  st.c is built in
+ * directly, with the window side of win.h stubbed out, and recorded byte
+ * streams are fed through twrite() the way ttyread() would, drawing a frame
+ * every few kilobytes.  Reports the best throughput of a few runs, each on
+ * a new terminal, and what st.c allocated in the first one.
+ *
+ * Capture a stream with e.g. `script -q -c 'ls --color=always -lR /usr' f`
+ * and run `./bench f`.  Traces recorded with `st -r` work too: their output
+ * is replayed with the recorded resizes, as fast as it parses.
+ */
+#include <locale.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef struct {
+	size_t at; /* offset into the output of the trace */
+	int col, row;
+} Resize;
+
+static size_t nallocs, nallocbytes;
+
+static void *
+benchmalloc(size_t len)
+{
+	nallocs++;
+	nallocbytes += len;
+	return malloc(len);
+}
+
+static void *
+benchrealloc(void *p, size_t len)
+{
+	nallocs++;
+	nallocbytes += len;
+	return realloc(p, len);
+}
+
+static char *
+benchstrdup(const char *s)
+{
+	nallocs++;
+	nallocbytes += strlen(s) + 1;
+	return strdup(s);
+}
+
+#define malloc(len)		benchmalloc(len)
+#define realloc(p, len)		benchrealloc(p, len)
+#define strdup(s)		benchstrdup(s)
+
+#include "st.c"
+
+#undef malloc
+#undef realloc
+#undef strdup
+
+#include "arg.h"
+
+char *argv0;
+
+#include "headless.h"
+
+static char *
+readall(const char *path, size_t *len)
+{
+	FILE *fp;
+	char *buf = NULL;
+	size_t siz = 0, n;
+
+	if (!strcmp(path, "-"))
+		fp = stdin;
+	else if (!(fp = fopen(path, "r")))
+		die("can't open %s: %s\n", path, strerror(errno));
+
+	*len = 0;
+	do {
+		if (*len == siz)
+			buf = xrealloc(buf, siz = siz ? 2 * siz : BUFSIZ);
+		n = fread(buf + *len, 1, siz - *len, fp);
+		*len += n;
+	} while (n > 0);
+	if (ferror(fp))
+		die("can't read %s: %s\n", path, strerror(errno));
+	if (fp != stdin)
+		fclose(fp);
+
+	return buf;
+}
+
+/*
+ * Squeezes the output records of a trace together at the start of buf and
+ * collects its resizes. Returns the length of the output.
+ */
+static size_t
+untrace(char *buf, size_t len, Resize **rs, int *nrs)
+{
+	const uchar *p;
+	size_t off, n, out = 0;
+
+	for (off = sizeof(TRACE_MAGIC) - 1; len - off >= TRACE_HDR_SIZ;
+	     off += TRACE_HDR_SIZ + n) {
+		p = (uchar *)buf + off;
+		if ((n = getle32(p + 5)) > len - off - TRACE_HDR_SIZ)
+			break;
+		p += TRACE_HDR_SIZ;
+
+		switch (buf[off]) {
+		case TREC_OUT:
+			memmove(buf + out, p, n);
+			out += n;
+			break;
+		case TREC_RESIZE:
+			if (n != 4)
+				break;
+			*rs = xrealloc(*rs, (*nrs + 1) * sizeof(Resize));
+			(*rs)[*nrs].at = out;
+			(*rs)[*nrs].col = p[0] | p[1] << 8;
+			(*rs)[*nrs].row = p[2] | p[3] << 8;
+			(*nrs)++;
+			break;
+		}
+	}
+
+	return out;
+}
+
+/* Frees all the terminal holds, so that tnew() starts from nothing. */
+static void
+tfree(void)
+{
+	HistLine *h;
+	int k;
+
+	for (k = 0; k < term.histn; k++) {
+		h = &term.hist[(term.histi - k + term.histcap) % term.histcap];
+		free(h->line);
+		free(h->packed);
+	}
+	free(term.hist);
+	free(term.histthaw);
+	free(term.linebuf.cells);
+	free(term.linebuf.map);
+	free(term.altbuf.cells);
+	free(term.altbuf.map);
+	free(term.dirtymap);
+	free(term.urls);
+	free(term.pair);
+	free(term.pairhash);
+	free(term.tabs);
+}
+
+/* Feeds the stream to the terminal, returns the time it took in ns. */
+static double
+replay(const char *buf, size_t len, size_t frame, Resize *rs, int nrs)
+{
+	struct timespec start, end;
+	size_t off = 0, lim, n;
+	int r = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (off < len) {
+		for (; r < nrs && rs[r].at <= off; r++)
+			tresize(rs[r].col, rs[r].row);
+		lim = (r < nrs) ? rs[r].at : len;
+
+		n = MIN(lim - off, frame);
+		n = twrite(buf + off, tcolroom(n), 0);
+		if (n == 0) {
+			/* an incomplete UTF-8 sequence at the very end */
+			if (r == nrs)
+				break;
+			/* or cut by a resize */
+			tresize(rs[r].col, rs[r].row);
+			r++;
+			continue;
+		}
+		off += n;
+		draw();
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	return (end.tv_sec - start.tv_sec) * 1E9 +
+	       (end.tv_nsec - start.tv_nsec);
+}
+
+static void
+usage(void)
+{
+	die("usage: %s [-c cols] [-r rows] [-n runs] [-f framebytes]"
+	    " [file ...]\n", argv0);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int cols = 80, rows = 24, runs = 5, i, r, nrs;
+	size_t frame = 64 * 1024, len, allocs = 0, allocbytes = 0;
+	double ns, best;
+	char *stdinonly[] = { "-", NULL }, *buf;
+	Resize *rs = NULL;
+
+	ARGBEGIN {
+	case 'c':
+		cols = atoi(EARGF(usage()));
+		break;
+	case 'r':
+		rows = atoi(EARGF(usage()));
+		break;
+	case 'n':
+		runs = atoi(EARGF(usage()));
+		break;
+	case 'f':
+		frame = atoi(EARGF(usage()));
+		break;
+	default:
+		usage();
+	} ARGEND;
+
+	if (cols < 1 || rows < 1 || runs < 1 || frame < UTF_SIZ)
+		usage();
+	if (argc == 0)
+		argv = stdinonly;
+
+	setlocale(LC_CTYPE, "");
+
+	/* answers to queries in the streams go nowhere */
+	if ((cmdfd = open("/dev/null", O_WRONLY)) < 0)
+		die("can't open /dev/null: %s\n", strerror(errno));
+	if (pipe(ttyring.fd) < 0)
+		die("pipe failed: %s\n", strerror(errno));
+
+	tnew(cols, rows);
+	selinit();
+
+	printf("%-24s %12s %10s %10s %10s %12s\n", "stream", "bytes",
+	       "MB/s", "ns/byte", "allocs", "alloc bytes");
+	for (i = 0; argv[i]; i++) {
+		buf = readall(argv[i], &len);
+		nrs = 0;
+		if (len >= sizeof(TRACE_MAGIC) - 1 &&
+		    !memcmp(buf, TRACE_MAGIC, sizeof(TRACE_MAGIC) - 1))
+			len = untrace(buf, len, &rs, &nrs);
+		if (len == 0) {
+			free(buf);
+			continue;
+		}
+
+		/* the fastest run, the others only had more noise */
+		best = -1;
+		for (r = 0; r < runs; r++) {
+			/* each run starts from a new terminal, history and all */
+			tfree();
+			tnew(cols, rows);
+			nallocs = nallocbytes = 0;
+			ns = replay(buf, len, frame, rs, nrs);
+			if (best < 0 || ns < best)
+				best = ns;
+			/* later runs find st.c's scratch buffers grown */
+			if (r == 0) {
+				allocs = nallocs;
+				allocbytes = nallocbytes;
+			}
+		}
+
+		printf("%-24s %12zu %10.1f %10.2f %10zu %12zu\n", argv[i],
+		       len, len / best * 1E3, best / len, allocs, allocbytes);
+		free(buf);
+	}
+
+	return 0;
+}
@@ -10,13 +10,33 @@
 /* Rounded non-negative integers division of n / d  */
 #define DIV(n, d) (((n) + (d) / 2) / (d))
 
+/* A8 coverage of one cell, what the shapes are rasterized into */
+typedef struct {
+	uchar *buf;
+	int stride;
+	int w, h;
+} Boxmask;
+
 static Display *xdpy;
 static Colormap xcmap;
 static XftDraw *xd;
 static Visual *xvis;
 
-static void drawbox(int, int, int, int, XftColor *, XftColor *, ushort);
-static void drawboxlines(int, int, int, int, XftColor *, ushort);
+/*
+ * The shapes, rasterized once for the current cell size and kept on the
+ * server as glyphs whose ids are their boxdrawindex().
+ */
+static GlyphSet glyphs;
+static XRenderPictFormat *a8;
+static int glyphw, glyphh;
+static uchar glyphadded[(1 << 16) / 8];
+static Picture src; /* solid fill of srccolor */
+static XRenderColor srccolor;
+
+static void boxglyph(ushort, int, int);
+static void boxrect(Boxmask *, int, int, int, int, int);
+static void drawbox(Boxmask *, int, int, int, int, ushort);
+static void drawboxlines(Boxmask *, int, int, int, int, ushort);
 
 /* public API */
 
@@ -24,6 +44,7 @@ void
 boxdraw_xinit(Display *dpy, Colormap cmap, XftDraw *draw, Visual *vis)
 {
 	xdpy = dpy; xcmap = cmap; xd = draw, xvis = vis;
+	a8 = XRenderFindStandardFormat(dpy, PictStandardA8);
 }
 
 int
@@ -49,83 +70,138 @@ void
 drawboxes(int x, int y, int cw, int ch, XftColor *fg, XftColor *bg,
           const XftGlyphFontSpec *specs, int len)
 {
-	for ( ; len-- > 0; x += cw, specs++)
-		drawbox(x, y, cw, ch, fg, bg, (ushort)specs->glyph);
+	unsigned int ids[256];
+	int n;
+
+	/* a new cell size after zooming, start over */
+	if (glyphs && (cw != glyphw || ch != glyphh)) {
+		XRenderFreeGlyphSet(xdpy, glyphs);
+		glyphs = 0;
+	}
+	if (!glyphs) {
+		glyphs = XRenderCreateGlyphSet(xdpy, a8);
+		glyphw = cw;
+		glyphh = ch;
+		memset(glyphadded, 0, sizeof(glyphadded));
+	}
+
+	if (!src || memcmp(&fg->color, &srccolor, sizeof(srccolor))) {
+		if (src)
+			XRenderFreePicture(xdpy, src);
+		srccolor = fg->color;
+		src = XRenderCreateSolidFill(xdpy, &srccolor);
+	}
+
+	/* shades blend over the background already drawn below them */
+	for ( ; len > 0; len -= n, x += n * cw) {
+		for (n = 0; n < len && n < LEN(ids); n++, specs++) {
+			ids[n] = (ushort)specs->glyph;
+			boxglyph(ids[n], cw, ch);
+		}
+		XRenderCompositeString32(xdpy, PictOpOver, src,
+		                         XftDrawPicture(xd), a8, glyphs,
+		                         0, 0, x, y, ids, n);
+	}
 }
 
 /* implementation */
 
 void
-drawbox(int x, int y, int w, int h, XftColor *fg, XftColor *bg, ushort bd)
+boxglyph(ushort bd, int w, int h)
+{
+	XGlyphInfo info = { .width = w, .height = h, .xOff = w };
+	XID id = bd; /* an X Glyph, st.h shadows the name */
+	Boxmask m;
+
+	if (glyphadded[bd / 8] & (1 << bd % 8))
+		return;
+	glyphadded[bd / 8] |= 1 << bd % 8;
+
+	m.w = w;
+	m.h = h;
+	m.stride = (w + 3) & ~3;
+	m.buf = xmalloc(m.stride * h);
+	memset(m.buf, 0, m.stride * h);
+	drawbox(&m, 0, 0, w, h, bd);
+	XRenderAddGlyphs(xdpy, glyphs, &id, &info, 1, (char *)m.buf,
+	                 m.stride * h);
+	free(m.buf);
+}
+
+/* Fills a rectangle of the mask with coverage a, clipped to the cell. */
+void
+boxrect(Boxmask *m, int a, int x, int y, int w, int h)
+{
+	int x2 = MIN(x + w, m->w), y2 = MIN(y + h, m->h);
+
+	for (y = MAX(y, 0); y < y2; y++)
+		if (MAX(x, 0) < x2)
+			memset(m->buf + y * m->stride + MAX(x, 0), a, x2 - MAX(x, 0));
+}
+
+void
+drawbox(Boxmask *m, int x, int y, int w, int h, ushort bd)
 {
 	ushort cat = bd & ~(BDB | 0xff);  /* mask out bold and data */
 	if (bd & (BDL | BDA)) {
 		/* lines (light/double/heavy/arcs) */
-		drawboxlines(x, y, w, h, fg, bd);
+		drawboxlines(m, x, y, w, h, bd);
 
 	} else if (cat == BBD) {
 		/* lower (8-X)/8 block */
 		int d = DIV((uint8_t)bd * h, 8);
-		XftDrawRect(xd, fg, x, y + d, w, h - d);
+		boxrect(m, 0xff, x, y + d, w, h - d);
 
 	} else if (cat == BBU) {
 		/* upper X/8 block */
-		XftDrawRect(xd, fg, x, y, w, DIV((uint8_t)bd * h, 8));
+		boxrect(m, 0xff, x, y, w, DIV((uint8_t)bd * h, 8));
 
 	} else if (cat == BBL) {
 		/* left X/8 block */
-		XftDrawRect(xd, fg, x, y, DIV((uint8_t)bd * w, 8), h);
+		boxrect(m, 0xff, x, y, DIV((uint8_t)bd * w, 8), h);
 
 	} else if (cat == BBR) {
 		/* right (8-X)/8 block */
 		int d = DIV((uint8_t)bd * w, 8);
-		XftDrawRect(xd, fg, x + d, y, w - d, h);
+		boxrect(m, 0xff, x + d, y, w - d, h);
 
 	} else if (cat == BBQ) {
 		/* Quadrants */
 		int w2 = DIV(w, 2), h2 = DIV(h, 2);
 		if (bd & TL)
-			XftDrawRect(xd, fg, x, y, w2, h2);
+			boxrect(m, 0xff, x, y, w2, h2);
 		if (bd & TR)
-			XftDrawRect(xd, fg, x + w2, y, w - w2, h2);
+			boxrect(m, 0xff, x + w2, y, w - w2, h2);
 		if (bd & BL)
-			XftDrawRect(xd, fg, x, y + h2, w2, h - h2);
+			boxrect(m, 0xff, x, y + h2, w2, h - h2);
 		if (bd & BR)
-			XftDrawRect(xd, fg, x + w2, y + h2, w - w2, h - h2);
+			boxrect(m, 0xff, x + w2, y + h2, w - w2, h - h2);
 
 	} else if (bd & BBS) {
 		/* Shades - data is 1/2/3 for 25%/50%/75% alpha, respectively */
 		int d = (uint8_t)bd;
-		XftColor xfc;
-		XRenderColor xrc = { .alpha = 0xffff };
-
-		xrc.red = DIV(fg->color.red * d + bg->color.red * (4 - d), 4);
-		xrc.green = DIV(fg->color.green * d + bg->color.green * (4 - d), 4);
-		xrc.blue = DIV(fg->color.blue * d + bg->color.blue * (4 - d), 4);
 
-		XftColorAllocValue(xdpy, xvis, xcmap, &xrc, &xfc);
-		XftDrawRect(xd, &xfc, x, y, w, h);
-		XftColorFree(xdpy, xvis, xcmap, &xfc);
+		boxrect(m, DIV(255 * d, 4), x, y, w, h);
 
 	} else if (cat == BRL) {
 		/* braille, each data bit corresponds to one dot at 2x4 grid */
 		int w1 = DIV(w, 2);
 		int h1 = DIV(h, 4), h2 = DIV(h, 2), h3 = DIV(3 * h, 4);
 
-		if (bd & 1)   XftDrawRect(xd, fg, x, y, w1, h1);
-		if (bd & 2)   XftDrawRect(xd, fg, x, y + h1, w1, h2 - h1);
-		if (bd & 4)   XftDrawRect(xd, fg, x, y + h2, w1, h3 - h2);
-		if (bd & 8)   XftDrawRect(xd, fg, x + w1, y, w - w1, h1);
-		if (bd & 16)  XftDrawRect(xd, fg, x + w1, y + h1, w - w1, h2 - h1);
-		if (bd & 32)  XftDrawRect(xd, fg, x + w1, y + h2, w - w1, h3 - h2);
-		if (bd & 64)  XftDrawRect(xd, fg, x, y + h3, w1, h - h3);
-		if (bd & 128) XftDrawRect(xd, fg, x + w1, y + h3, w - w1, h - h3);
+		if (bd & 1)   boxrect(m, 0xff, x, y, w1, h1);
+		if (bd & 2)   boxrect(m, 0xff, x, y + h1, w1, h2 - h1);
+		if (bd & 4)   boxrect(m, 0xff, x, y + h2, w1, h3 - h2);
+		if (bd & 8)   boxrect(m, 0xff, x + w1, y, w - w1, h1);
+		if (bd & 16)  boxrect(m, 0xff, x + w1, y + h1, w - w1, h2 - h1);
+		if (bd & 32)  boxrect(m, 0xff, x + w1, y + h2, w - w1, h3 - h2);
+		if (bd & 64)  boxrect(m, 0xff, x, y + h3, w1, h - h3);
+		if (bd & 128) boxrect(m, 0xff, x + w1, y + h3, w - w1, h - h3);
 
 	}
 }
 
 void
-drawboxlines(int x, int y, int w, int h, XftColor *fg, ushort bd)
+drawboxlines(Boxmask *m, int x, int y, int w, int h, ushort bd)
 {
 	/* s: stem thickness. width/8 roughly matches underscore thickness. */
 	/* We draw bold as 1.5 * normal-stem and at least 1px thicker.      */
@@ -151,13 +227,13 @@ drawboxlines(int x, int y, int w, int h, XftColor *fg, ushort bd)
 		int d = arc || (multi_double && !multi_light) ? -s : 0;
 
 		if (bd & LL)
-			XftDrawRect(xd, fg, x, y + h2, w2 + s + d, s);
+			boxrect(m, 0xff, x, y + h2, w2 + s + d, s);
 		if (bd & LU)
-			XftDrawRect(xd, fg, x + w2, y, s, h2 + s + d);
+			boxrect(m, 0xff, x + w2, y, s, h2 + s + d);
 		if (bd & LR)
-			XftDrawRect(xd, fg, x + w2 - d, y + h2, w - w2 + d, s);
+			boxrect(m, 0xff, x + w2 - d, y + h2, w - w2 + d, s);
 		if (bd & LD)
-			XftDrawRect(xd, fg, x + w2, y + h2 - d, s, h - h2 + d);
+			boxrect(m, 0xff, x + w2, y + h2 - d, s, h - h2 + d);
 	}
 
 	/* double lines - also align with light to form heavy when combined */
@@ -172,23 +248,23 @@ drawboxlines(int x, int y, int w, int h, XftColor *fg, ushort bd)
 		int dl = bd & DL, du = bd & DU, dr = bd & DR, dd = bd & DD;
 		if (dl) {
 			int p = dd ? -s : 0, n = du ? -s : dd ? s : 0;
-			XftDrawRect(xd, fg, x, y + h2 + s, w2 + s + p, s);
-			XftDrawRect(xd, fg, x, y + h2 - s, w2 + s + n, s);
+			boxrect(m, 0xff, x, y + h2 + s, w2 + s + p, s);
+			boxrect(m, 0xff, x, y + h2 - s, w2 + s + n, s);
 		}
 		if (du) {
 			int p = dl ? -s : 0, n = dr ? -s : dl ? s : 0;
-			XftDrawRect(xd, fg, x + w2 - s, y, s, h2 + s + p);
-			XftDrawRect(xd, fg, x + w2 + s, y, s, h2 + s + n);
+			boxrect(m, 0xff, x + w2 - s, y, s, h2 + s + p);
+			boxrect(m, 0xff, x + w2 + s, y, s, h2 + s + n);
 		}
 		if (dr) {
 			int p = du ? -s : 0, n = dd ? -s : du ? s : 0;
-			XftDrawRect(xd, fg, x + w2 - p, y + h2 - s, w - w2 + p, s);
-			XftDrawRect(xd, fg, x + w2 - n, y + h2 + s, w - w2 + n, s);
+			boxrect(m, 0xff, x + w2 - p, y + h2 - s, w - w2 + p, s);
+			boxrect(m, 0xff, x + w2 - n, y + h2 + s, w - w2 + n, s);
 		}
 		if (dd) {
 			int p = dr ? -s : 0, n = dl ? -s : dr ? s : 0;
-			XftDrawRect(xd, fg, x + w2 + s, y + h2 - p, s, h - h2 + p);
-			XftDrawRect(xd, fg, x + w2 - s, y + h2 - n, s, h - h2 + n);
+			boxrect(m, 0xff, x + w2 + s, y + h2 - p, s, h - h2 + p);
+			boxrect(m, 0xff, x + w2 - s, y + h2 - n, s, h - h2 + n);
 		}
 	}
 }
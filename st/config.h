@@ -57,6 +57,13 @@ int allowwindowops = 0;
 static double minlatency = 8;
 static double maxlatency = 33;
 
+/*
+ * while output floods in, frames are skipped as long as more than a screen
+ * scrolled by since the last one; only the final state gets drawn. one frame
+ * is still drawn every floodlatency ms so that progress stays visible.
+ */
+static double floodlatency = 250;
+
 /*
  * blinking timeout (set to 0 to disable blinking) for the terminal blinking
  * attribute.
@@ -106,6 +113,12 @@ char *termname = "st-256color";
  */
 unsigned int tabspaces = 8;
 
+/*
+ * maximum number of lines kept in the scrollback history (0 disables it).
+ * History lines are only allocated once they scroll off the screen.
+ */
+unsigned int histsize = 100000;
+
 /* bg opacity */
 float alpha = 0.8;
 float alphaOffset = 0.0;
@@ -216,6 +229,7 @@ ResourcePref resources[] = {
 		{ "blinktimeout", INTEGER, &blinktimeout },
 		{ "bellvolume",   INTEGER, &bellvolume },
 		{ "tabspaces",    INTEGER, &tabspaces },
+		{ "histsize",     INTEGER, &histsize },
 		{ "borderpx",     INTEGER, &borderpx },
 		{ "cwscale",      FLOAT,   &cwscale },
 		{ "chscale",      FLOAT,   &chscale },
@@ -242,8 +256,8 @@ static MouseShortcut mshortcuts[] = {
 #define MODKEY Mod1Mask
 #define TERMMOD (Mod1Mask|ShiftMask)
 
-static char *openurlcmd[] = { "/bin/sh", "-c", "st-urlhandler -o", "externalpipe", NULL };
-static char *copyurlcmd[] = { "/bin/sh", "-c", "st-urlhandler -c", "externalpipe", NULL };
+/* opens the URLs picked with the hints, the URL is appended */
+static char *urlopencmd[] = { "xdg-open", NULL };
 static char *copyoutput[] = { "/bin/sh", "-c", "st-copyout", "externalpipe", NULL };
 
 static Shortcut shortcuts[] = {
@@ -280,9 +294,11 @@ static Shortcut shortcuts[] = {
 	{ TERMMOD,              XK_J,           zoom,           {.f = -1} },
 	{ TERMMOD,              XK_U,           zoom,           {.f = +2} },
 	{ TERMMOD,              XK_D,           zoom,           {.f = -2} },
-	{ MODKEY,               XK_l,           externalpipe,   {.v = openurlcmd } },
-	{ MODKEY,               XK_y,           externalpipe,   {.v = copyurlcmd } },
+	{ MODKEY,               XK_l,           urlhints,       {.i =  0} },
+	{ MODKEY,               XK_y,           urlhints,       {.i =  1} },
 	{ MODKEY,               XK_o,           externalpipe,   {.v = copyoutput } },
+	{ TERMMOD,              XK_S,           togglestats,    {.i =  0} },
+	{ TERMMOD,              XK_F,           searchstart,    {.i =  0} },
 	{ ControlMask | ShiftMask,               XK_C,           clipcopy,       {.i =  0} },
   	{ ShiftMask,            XK_Insert,      clippaste,      {.i =  0} },
   	{ ControlMask | ShiftMask,               XK_V,           clippaste,      {.i =  0} },
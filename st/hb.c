@@ -1,5 +1,7 @@
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
 #include <X11/Xft/Xft.h>
 #include <X11/cursorfont.h>
@@ -29,13 +31,46 @@ typedef struct {
 	hb_font_t *font;
 } HbFontMatch;
 
+/*
+ * Open addressed hash of XftFont to hb_font_t, linear probing on the font
+ * pointer.  Kept at most half full, hbfontscap is a power of two.
+ */
 static int hbfontslen = 0;
+static int hbfontscap = 0;
 static HbFontMatch *hbfontcache = NULL;
 
+static unsigned int hbfonthash(XftFont *);
+
+/*
+ * Shaping cache: glyph ids hb_shape() produced for a run of runes in a given
+ * font.  The attributes only pick the font and split the segments, so the
+ * font and the runes are all the key needs.  Direct mapped, a colliding
+ * segment simply takes the slot over.
+ */
+typedef struct {
+	XftFont *font;
+	unsigned int hash;
+	int len, cap;
+	Rune *runes;
+	hb_codepoint_t *glyphs; /* shares the allocation of runes */
+} HbShapeCache;
+
+#define HBSHAPECACHESIZ 512 /* must be a power of two */
+
+static HbShapeCache hbshapecache[HBSHAPECACHESIZ];
+
+/* Scratch space reused across calls. */
+static hb_buffer_t *hbbuffer = NULL;
+static hb_codepoint_t *hbcodepoints = NULL;
+static Rune *hbrunes = NULL;
+static size_t hbscratchlen = 0;
+
 void
 hbunloadfonts()
 {
-	for (int i = 0; i < hbfontslen; i++) {
+	for (int i = 0; i < hbfontscap; i++) {
+		if (hbfontcache[i].match == NULL)
+			continue;
 		hb_font_destroy(hbfontcache[i].font);
 		XftUnlockFace(hbfontcache[i].match);
 	}
@@ -45,25 +80,66 @@ hbunloadfonts()
 		hbfontcache = NULL;
 	}
 	hbfontslen = 0;
+	hbfontscap = 0;
+
+	/* Cached shapes refer to the fonts just closed. */
+	for (int i = 0; i < HBSHAPECACHESIZ; i++) {
+		free(hbshapecache[i].runes);
+		hbshapecache[i] = (HbShapeCache){ 0 };
+	}
+}
+
+unsigned int
+hbfonthash(XftFont *match)
+{
+	return (unsigned int)((uintptr_t)match >> 4) * 2654435761u;
 }
 
 hb_font_t *
 hbfindfont(XftFont *match)
 {
-	for (int i = 0; i < hbfontslen; i++) {
-		if (hbfontcache[i].match == match)
-			return hbfontcache[i].font;
+	HbFontMatch *old;
+	int i, oldcap;
+
+	if (hbfontscap) {
+		for (i = hbfonthash(match) & (hbfontscap - 1);
+		     hbfontcache[i].match != NULL;
+		     i = (i + 1) & (hbfontscap - 1)) {
+			if (hbfontcache[i].match == match)
+				return hbfontcache[i].font;
+		}
 	}
 
 	/* Font not found in cache, caching it now. */
-	hbfontcache = realloc(hbfontcache, sizeof(HbFontMatch) * (hbfontslen + 1));
+	if (2 * (hbfontslen + 1) > hbfontscap) {
+		old = hbfontcache;
+		oldcap = hbfontscap;
+		hbfontscap = oldcap ? 2 * oldcap : 16;
+		hbfontcache = xmalloc(hbfontscap * sizeof(HbFontMatch));
+		memset(hbfontcache, 0, hbfontscap * sizeof(HbFontMatch));
+		for (int j = 0; j < oldcap; j++) {
+			if (old[j].match == NULL)
+				continue;
+			for (i = hbfonthash(old[j].match) & (hbfontscap - 1);
+			     hbfontcache[i].match != NULL;
+			     i = (i + 1) & (hbfontscap - 1))
+				;
+			hbfontcache[i] = old[j];
+		}
+		free(old);
+	}
+	for (i = hbfonthash(match) & (hbfontscap - 1);
+	     hbfontcache[i].match != NULL;
+	     i = (i + 1) & (hbfontscap - 1))
+		;
+
 	FT_Face face = XftLockFace(match);
 	hb_font_t *font = hb_ft_font_create(face, NULL);
 	if (font == NULL)
 		die("Failed to load Harfbuzz font.");
 
-	hbfontcache[hbfontslen].match = match;
-	hbfontcache[hbfontslen].font = font;
+	hbfontcache[i].match = match;
+	hbfontcache[i].font = font;
 	hbfontslen += 1;
 
 	return font;
@@ -72,8 +148,17 @@ hbfindfont(XftFont *match)
 void
 hbtransform(XftGlyphFontSpec *specs, const Glyph *glyphs, size_t len, int x, int y)
 {
-	int start = 0, length = 1, gstart = 0;
-	hb_codepoint_t *codepoints = calloc((unsigned int)len, sizeof(hb_codepoint_t));
+	int start = 0, length = 1, gstart = 0, s1, s2;
+	hb_codepoint_t *codepoints;
+
+	if (hbscratchlen < len) {
+		hbscratchlen = len;
+		hbcodepoints = xrealloc(hbcodepoints, len * sizeof(hb_codepoint_t));
+		hbrunes = xrealloc(hbrunes, len * sizeof(Rune));
+	}
+	codepoints = hbcodepoints;
+	/* segments also break where the selection starts or ends */
+	selspan(y, &s1, &s2);
 
 	for (int idx = 1, specidx = 1; idx < len; idx++) {
 		if (glyphs[idx].mode & ATTR_WDUMMY) {
@@ -81,7 +166,7 @@ hbtransform(XftGlyphFontSpec *specs, const Glyph *glyphs, size_t len, int x, int
 			continue;
 		}
 
-		if (specs[specidx].font != specs[start].font || ATTRCMP(glyphs[gstart], glyphs[idx]) || selected(x + idx, y) != selected(x + gstart, y)) {
+		if (specs[specidx].font != specs[start].font || ATTRCMP(glyphs[gstart], glyphs[idx]) || (x + idx >= s1 && x + idx < s2) != (x + gstart >= s1 && x + gstart < s2)) {
 			hbtransformsegment(specs[start].font, glyphs, codepoints, gstart, length);
 
 			/* Reset the sequence. */
@@ -112,36 +197,48 @@ hbtransform(XftGlyphFontSpec *specs, const Glyph *glyphs, size_t len, int x, int
 
 		specs[specidx++].glyph = codepoints[i];
 	}
-
-	free(codepoints);
 }
 
 void
 hbtransformsegment(XftFont *xfont, const Glyph *string, hb_codepoint_t *codepoints, int start, int length)
 {
+	Rune *runes = hbrunes + start;
+	unsigned int hash = 2166136261u ^ (unsigned int)(uintptr_t)xfont;
+	HbShapeCache *c;
+
+	for (int i = 0; i < length; i++) {
+		runes[i] = string[start+i].u;
+		if (string[start+i].mode & ATTR_WDUMMY)
+			runes[i] = 0x0020;
+		hash = (hash ^ runes[i]) * 16777619u;
+	}
+
+	/* Seen this segment before, reuse its glyphs. */
+	c = &hbshapecache[hash & (HBSHAPECACHESIZ - 1)];
+	if (c->font == xfont && c->hash == hash && c->len == length &&
+	    !memcmp(c->runes, runes, length * sizeof(Rune))) {
+		memcpy(codepoints + start, c->glyphs, length * sizeof(hb_codepoint_t));
+		return;
+	}
+
 	hb_font_t *font = hbfindfont(xfont);
 	if (font == NULL)
 		return;
 
-	Rune rune;
-	ushort mode = USHRT_MAX;
-	hb_buffer_t *buffer = hb_buffer_create();
-	hb_buffer_set_direction(buffer, HB_DIRECTION_LTR);
+	if (hbbuffer == NULL)
+		hbbuffer = hb_buffer_create();
+	hb_buffer_clear_contents(hbbuffer);
+	hb_buffer_set_direction(hbbuffer, HB_DIRECTION_LTR);
 
 	/* Fill buffer with codepoints. */
-	for (int i = start; i < (start+length); i++) {
-		rune = string[i].u;
-		mode = string[i].mode;
-		if (mode & ATTR_WDUMMY)
-			rune = 0x0020;
-		hb_buffer_add_codepoints(buffer, &rune, 1, 0, 1);
-	}
+	for (int i = 0; i < length; i++)
+		hb_buffer_add_codepoints(hbbuffer, &runes[i], 1, 0, 1);
 
 	/* Shape the segment. */
-	hb_shape(font, buffer, features, sizeof(features));
+	hb_shape(font, hbbuffer, features, sizeof(features));
 
 	/* Get new glyph info. */
-	hb_glyph_info_t *info = hb_buffer_get_glyph_infos(buffer, NULL);
+	hb_glyph_info_t *info = hb_buffer_get_glyph_infos(hbbuffer, NULL);
 
 	/* Write new codepoints. */
 	for (int i = 0; i < length; i++) {
@@ -149,6 +246,15 @@ hbtransformsegment(XftFont *xfont, const Glyph *string, hb_codepoint_t *codepoin
 		codepoints[start+i] = gid;
 	}
 
-	/* Cleanup. */
-	hb_buffer_destroy(buffer);
+	/* Remember the result. */
+	if (c->cap < length) {
+		c->cap = length;
+		c->runes = xrealloc(c->runes, length * (sizeof(Rune) + sizeof(hb_codepoint_t)));
+	}
+	c->glyphs = (hb_codepoint_t *)(c->runes + c->cap);
+	memcpy(c->runes, runes, length * sizeof(Rune));
+	memcpy(c->glyphs, codepoints + start, length * sizeof(hb_codepoint_t));
+	c->font = xfont;
+	c->hash = hash;
+	c->len = length;
 }
@@ -0,0 +1,32 @@
+/* See LICENSE for license details. */
+
+/*
+ * What x.c and config.h give st.c, for the programs which build st.c in
+ * without a window: bench.c and replaytest.c. Include it after st.c.
+ */
+
+/* config.h globals, copied out of it by make, see the Makefile */
+#include "benchconfig.h"
+
+/* the window does nothing */
+int isboxdraw(Rune u) { return 0; }
+void xbell(void) {}
+void xclipcopy(void) {}
+void xdrawcursor(int cx, int cy, Glyph g, int ox, int oy, Glyph og,
+                 Line line, int len) {}
+void xdrawline(Line line, int x1, int y1, int x2) {}
+void xfinishdraw(void) {}
+void xloadcols(void) {}
+void xscroll(int top, int bot, int n) {}
+int xsetcolorname(int x, const char *name) { return 0; }
+int xgetcolor(int x, unsigned char *r, unsigned char *g, unsigned char *b)
+	{ return 1; }
+void xseticontitle(char *p) {}
+void xsettitle(char *p) {}
+int xsetcursor(int cursor) { return 0; }
+void xsetmode(int set, unsigned int flags) {}
+void xsetpointermotion(int set) {}
+void xsetsel(char *str) {}
+void xsetsize(int col, int row) { tresize(col, row); }
+int xstartdraw(void) { return 1; }
+void xximspot(int x, int y) {}
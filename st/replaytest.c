@@ -0,0 +1,81 @@
+/* See LICENSE for license details. */
+
+/*
+ * Replays a trace through the reader thread and ttyread(), the way
+ * `st -P` does, and checks the screen it leaves. The trace has an output
+ * record ending inside a UTF-8 sequence, followed by a resize.
+ */
+#include "st.c"
+#include "headless.h"
+
+static char path[] = "/tmp/st-replaytest-XXXXXX";
+
+static void
+record(FILE *fp, int type, const char *s, size_t n)
+{
+	uchar hdr[TRACE_HDR_SIZ];
+
+	hdr[0] = type;
+	putle32(hdr + 1, 0);
+	putle32(hdr + 5, n);
+	fwrite(hdr, 1, sizeof(hdr), fp);
+	fwrite(s, 1, n, fp);
+}
+
+/* ttyread() exits once the whole trace is parsed */
+static void
+check(void)
+{
+	Rune want[] = { 'a', 'b', 0x20ac, 'c' };
+	int x;
+
+	unlink(path);
+	if (term.col != 40 || term.row != 10) {
+		fprintf(stderr, "replaytest: %dx%d, not 40x10\n",
+		        term.col, term.row);
+		_exit(1);
+	}
+	for (x = 0; x < LEN(want); x++) {
+		if (term.line[0][x].u != want[x]) {
+			fprintf(stderr, "replaytest: U+%04X at %d, not U+%04X\n",
+			        term.line[0][x].u, x, want[x]);
+			_exit(1);
+		}
+	}
+	puts("replaytest: ok");
+}
+
+int
+main(void)
+{
+	FILE *fp;
+	fd_set rfd;
+	int fd;
+
+	/* a hang fails too */
+	alarm(10);
+
+	if ((fd = mkstemp(path)) < 0 || !(fp = fdopen(fd, "w")))
+		die("can't create %s: %s\n", path, strerror(errno));
+	fputs(TRACE_MAGIC, fp);
+	record(fp, TREC_OUT, "ab\342\202", 4);
+	record(fp, TREC_RESIZE, "\050\000\012\000", 4);
+	record(fp, TREC_OUT, "\254c", 2);
+	fclose(fp);
+
+	if ((cmdfd = open("/dev/null", O_WRONLY)) < 0)
+		die("can't open /dev/null: %s\n", strerror(errno));
+	traceopen(path, TRACE_REPLAYFAST);
+	tnew(80, 24);
+	selinit();
+	fd = ttyreaderstart();
+	atexit(check);
+
+	for (;;) {
+		FD_ZERO(&rfd);
+		FD_SET(fd, &rfd);
+		if (select(fd + 1, &rfd, NULL, NULL, NULL) < 0 && errno != EINTR)
+			die("select failed: %s\n", strerror(errno));
+		ttyread();
+	}
+}
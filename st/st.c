@@ -3,6 +3,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <pwd.h>
 #include <stdarg.h>
 #include <stdio.h>
@@ -14,8 +15,15 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 #include <wchar.h>
+#include <wctype.h>
+#if defined(__AVX2__)
+ #include <immintrin.h>
+#elif defined(__SSE2__)
+ #include <emmintrin.h>
+#endif
 
 #include "st.h"
 #include "win.h"
@@ -35,7 +43,16 @@
 #define ESC_ARG_SIZ   16
 #define STR_BUF_SIZ   ESC_BUF_SIZ
 #define STR_ARG_SIZ   ESC_ARG_SIZ
-#define HISTSIZE      2000
+#define HIST_MINCAP   256
+#define HIST_HOT      256 /* newest history lines kept unpacked */
+#define HIST_TRIBITS  256 /* size of the trigram filter of history lines */
+#define TTY_RING_SIZ  (1 << 20) /* pty input buffered by the reader thread */
+#define TRACE_MAGIC   "sttrace1"
+#define TRACE_HDR_SIZ 9
+#define PIPE_OUT_SIZ  (64*1024) /* buffered output of externalpipe() */
+#define URL_PER_LINE  8
+#define COL_BITS      9 /* palette colours held in Glyph.col, see tcolpair() */
+#define COL_PAIRED    (1 << 2 * COL_BITS)
 
 /* macros */
 #define IS_SET(flag)		((term.mode & (flag)) != 0)
@@ -43,10 +60,11 @@
 #define ISCONTROLC1(c)		(BETWEEN(c, 0x80, 0x9f))
 #define ISCONTROL(c)		(ISCONTROLC0(c) || ISCONTROLC1(c))
 #define ISDELIM(u)		(u && wcschr(worddelimiters, u))
-#define TLINE(y)		((y) < term.scr ? term.hist[((y) + term.histi - \
-				term.scr + HISTSIZE + 1) % HISTSIZE] : \
+#define ISPRINTASCII(c)		BETWEEN(c, 0x20, 0x7e)
+#define TLINE(y)		((y) < term.scr ? thist(term.scr - (y) - 1) : \
 				term.line[(y) - term.scr])
-#define TLINE_HIST(y)           ((y) <= HISTSIZE-term.row+2 ? term.hist[(y)] : term.line[(y-HISTSIZE+term.row-3)])
+#define TLINE_HIST(y)		((y) < term.histn ? thist(term.histn - (y) - 1) : \
+				term.line[(y) - term.histn])
 
 enum term_mode {
 	MODE_WRAP        = 1 << 0,
@@ -96,6 +114,94 @@ typedef struct {
 	char state;
 } TCursor;
 
+/*
+ * Cells of a screen, one block of them, and the map of its rows. The map
+ * has twice as many rows as the screen, which is a window sliding over
+ * it, see tslide().
+ */
+typedef struct {
+	Glyph *cells;
+	Line *map;
+	int col;      /* glyphs in a row of cells */
+} ScreenBuf;
+
+/* Colours of a glyph that do not fit in Glyph.col */
+typedef struct {
+	uint32_t fg;
+	uint32_t bg;
+} ColPair;
+
+/* Packed history line: attribute runs followed by the UTF-8 text */
+typedef struct {
+	ushort n;     /* cells in run */
+	ushort mode;
+	uint32_t fg;
+	uint32_t bg;
+} AttrRun;
+
+typedef struct {
+	int col;      /* width of the line it was packed from */
+	int len;      /* cells with text, the rest are spaces */
+	int nrun;     /* nb of attribute runs */
+	int ntext;    /* bytes of text after the runs */
+	AttrRun run[];
+} PackedLine;
+
+typedef struct {
+	Line line;    /* glyphs, NULL while the line is only packed */
+	PackedLine *packed; /* compact copy of cold lines */
+	int col;      /* allocated width of line */
+	uint64_t tri[HIST_TRIBITS / 64]; /* trigrams in it, see thistindex() */
+} HistLine;
+
+/*
+ * Pty input ring: the reader thread is its only producer, the main thread
+ * its only consumer. head and tail count bytes since the start and only
+ * grow; the thread only blocks on room when the ring is full.
+ */
+typedef struct {
+	char *buf;
+	size_t head;  /* written by the reader thread */
+	size_t tail;  /* written by the main thread */
+	int eof;      /* the reader thread is gone */
+	int err;      /* errno of the read that ended it, 0 on EOF */
+	int fd[2];    /* pipe waking up the main thread */
+	int resize;   /* col << 16 | row asked for by a replayed trace */
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t room;
+} TtyRing;
+
+/*
+ * Bytes for the pty which did not fit in it yet. cmdfd is non-blocking,
+ * ttyflush() writes them out as run() finds it writable again.
+ */
+typedef struct {
+	char *buf;
+	size_t off;   /* written out already */
+	size_t len;
+	size_t cap;
+} TtyQueue;
+
+/*
+ * Session trace, see traceopen(). A trace is TRACE_MAGIC followed by
+ * records: a type byte, the microseconds since the previous record and
+ * the length of the payload, both 32 bit little endian, then the payload.
+ * A resize carries the new columns and rows, 16 bit each.
+ */
+enum trace_record {
+	TREC_IN     = 'i', /* written to the pty */
+	TREC_OUT    = 'o', /* read from the pty */
+	TREC_RESIZE = 'r',
+};
+
+typedef struct {
+	FILE *fp;
+	int mode;     /* enum trace_mode */
+	struct timespec last; /* time of the last record written */
+	pthread_mutex_t lock; /* records come from both threads */
+} Trace;
+
 typedef struct {
 	int mode;
 	int type;
@@ -114,6 +220,12 @@ typedef struct {
 	int alt;
 } Selection;
 
+/* URLs found on a row of the window: first and last cell of each */
+typedef struct {
+	int n;
+	ushort span[URL_PER_LINE][2];
+} UrlRow;
+
 /* Internal representation of the screen */
 typedef struct {
 	int row;      /* nb row */
@@ -121,11 +233,32 @@ typedef struct {
 	int maxcol;
 	Line *line;   /* screen */
 	Line *alt;    /* alternate screen */
-	Line hist[HISTSIZE]; /* history buffer */
-	int histi;    /* history index */
+	ScreenBuf linebuf; /* where line is, swapped along with it */
+	ScreenBuf altbuf;
+	HistLine *hist; /* history ring buffer, grown up to histsize */
+	int histcap;  /* allocated history slots */
+	int histn;    /* history lines in use */
+	int histi;    /* index of the newest history line */
+	int *histthaw; /* packed history slots unpacked for reading */
+	int histnthaw;
+	int histthawcap;
+	int histnstale; /* oldest history lines still wrapped at histcol, */
+	int histcol;  /* left for thistrewrap() by treflow() */
 	int scr;      /* scroll back */
+	int scrolled; /* lines scrolled since the last draw */
+	int blittop;  /* region scrolled since the last draw, to be */
+	int blitbot;  /* moved on the window instead of redrawn */
+	int blitn;    /* lines it moved up, negative when down */
 	int *dirty;   /* dirtyness of lines */
+	int *dirtymap; /* 2 * row flags dirty slides over with line */
+	UrlRow *urls; /* URLs on the window, see turlscan() */
+	ColPair *pair; /* colours of glyphs with COL_PAIRED */
+	uint32_t *pairhash; /* index + 1 in pair, 2 * paircap of them */
+	int npair;
+	int paircap;
+	int pairlive; /* pairs in use after the last tcolcompact() */
 	TCursor c;    /* cursor */
+	TCursor saved[2]; /* cursors stored by CURSOR_SAVE, per screen */
 	int ocx;      /* old cursor col */
 	int ocy;      /* old cursor row */
 	int top;      /* top    scroll limit */
@@ -165,6 +298,18 @@ static void execsh(char *, char **);
 static void stty(char **);
 static void sigchld(int);
 static void ttywriteraw(const char *, size_t);
+static int ttyreaderstart(void);
+static void *ttyreader(void *);
+static size_t ttyringroom(size_t);
+static void ttyringpush(size_t);
+static void ttyringclose(int);
+static int pipeput(int, char *, size_t *, const char *, size_t);
+static int packedmode(const PackedLine *, int);
+static void tracewrite(int, const char *, size_t);
+static void tracereplay(void);
+static void tracewait(struct timespec *, uint32_t);
+static uint32_t getle32(const uchar *);
+static void putle32(uchar *, uint32_t);
 
 static void csidump(void);
 static void csihandle(void);
@@ -193,14 +338,43 @@ static void tmoveato(int, int);
 static void tnewline(int);
 static void tputtab(int);
 static void tputc(Rune);
+static int tputascii(const char *, int);
 static void treset(void);
 static void tscrollup(int, int, int);
 static void tscrolldown(int, int, int);
+static void tscrollblit(int, int);
+static void tscrollview(int);
+static void tslide(int);
+static Line *tscreenalloc(ScreenBuf *, Line *, int, int, int, int);
 static void tsetattr(const int *, int);
+static uint32_t tcolapprox(uint32_t);
+static void tcolrehash(void);
+static void tcolcompact(void);
+static size_t tcolroom(size_t);
+static void tcolrepair(Glyph *, int, const ColPair *);
 static void tsetchar(Rune, const Glyph *, int, int);
 static void tsetdirt(int, int);
 static void tsetscroll(int, int);
 static void tswapscreen(void);
+static Line thist(int);
+static void thistpush(int);
+static void thistpack(HistLine *);
+static void thistindex(HistLine *, const Glyph *, int);
+static uint trihash(Rune, Rune, Rune);
+static int tsearchtext(int, int, int, Rune **, int **);
+static int tlinemode(int, int);
+static Line thistglyphs(const PackedLine *);
+static void thistunpack(int);
+static void thistsweep(void);
+static void thistfreeze(void);
+static void thistsplice(HistLine *, int);
+static void thistrewrap(void);
+static int tblank(const Glyph *);
+static int tpad(const Glyph *);
+static int treflowlen(int, int, int *);
+static Line treflowline(int);
+static HistLine *trewrap(int, int, int, int, int *, int *, int *, int *);
+static void treflow(int);
 static void tsetmode(int, int, const int *, int);
 static int twrite(const char *, int, int);
 static void tcontrolcode(uchar );
@@ -211,11 +385,16 @@ static void tdeftran(char);
 static void tstrsequence(uchar);
 
 static void drawregion(int, int, int, int);
+static void turlscan(int);
+static void turlscroll(int, int, int);
+static int isurlchar(Rune);
 
+static size_t getselline(int, char *);
 static void selnormalize(void);
 static void selscroll(int, int);
 static void selsnap(int *, int *, int);
 
+static int asciiprintlen(const char *, int);
 static size_t utf8decode(const char *, Rune *, size_t);
 static Rune utf8decodebyte(char, size_t *);
 static char utf8encodebyte(Rune, size_t);
@@ -233,7 +412,15 @@ static CSIEscape csiescseq;
 static STREscape strescseq;
 static int iofd = 1;
 static int cmdfd;
+static TtyQueue ttyqueue;
 static pid_t pid;
+static TtyRing ttyring = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.room = PTHREAD_COND_INITIALIZER
+};
+static Trace trace = {
+	.lock = PTHREAD_MUTEX_INITIALIZER
+};
 
 static const uchar utfbyte[UTF_SIZ + 1] = {0x80,    0, 0xC0, 0xE0, 0xF0};
 static const uchar utfmask[UTF_SIZ + 1] = {0xC0, 0x80, 0xE0, 0xF0, 0xF8};
@@ -290,6 +477,47 @@ xstrdup(const char *s)
 	return p;
 }
 
+/*
+ * Length of the leading run of printable ASCII (0x20 - 0x7e) in s. Bytes
+ * above 0x7f are negative as signed chars, so two signed compares per vector
+ * reject both control bytes and UTF-8 sequences.
+ */
+int
+asciiprintlen(const char *s, int len)
+{
+	int n = 0;
+#if defined(__AVX2__)
+	const __m256i lo32 = _mm256_set1_epi8(0x1f), hi32 = _mm256_set1_epi8(0x7f);
+	__m256i v32;
+	uint32_t m32;
+
+	for (; n + 32 <= len; n += 32) {
+		v32 = _mm256_loadu_si256((const __m256i *)(s + n));
+		m32 = _mm256_movemask_epi8(_mm256_and_si256(
+		      _mm256_cmpgt_epi8(v32, lo32), _mm256_cmpgt_epi8(hi32, v32)));
+		if (m32 != 0xffffffff)
+			return n + __builtin_ctz(~m32);
+	}
+#endif
+#if defined(__SSE2__)
+	const __m128i lo = _mm_set1_epi8(0x1f), hi = _mm_set1_epi8(0x7f);
+	__m128i v;
+	uint32_t m;
+
+	for (; n + 16 <= len; n += 16) {
+		v = _mm_loadu_si128((const __m128i *)(s + n));
+		m = _mm_movemask_epi8(_mm_and_si128(_mm_cmpgt_epi8(v, lo),
+		                                    _mm_cmplt_epi8(v, hi)));
+		if (m != 0xffff)
+			return n + __builtin_ctz(~m);
+	}
+#endif
+	while (n < len && ISPRINTASCII((uchar)s[n]))
+		n++;
+
+	return n;
+}
+
 size_t
 utf8decode(const char *c, Rune *u, size_t clen)
 {
@@ -520,17 +748,32 @@ selnormalize(void)
 int
 selected(int x, int y)
 {
-	if (sel.mode == SEL_EMPTY || sel.ob.x == -1 ||
-			sel.alt != IS_SET(MODE_ALTSCREEN))
-		return 0;
+	int x1, x2;
 
-	if (sel.type == SEL_RECTANGULAR)
-		return BETWEEN(y, sel.nb.y, sel.ne.y)
-		    && BETWEEN(x, sel.nb.x, sel.ne.x);
+	selspan(y, &x1, &x2);
+	return x >= x1 && x < x2;
+}
 
-	return BETWEEN(y, sel.nb.y, sel.ne.y)
-	    && (y != sel.nb.y || x >= sel.nb.x)
-	    && (y != sel.ne.y || x <= sel.ne.x);
+/*
+ * Sets [*x1, *x2) to the columns of line y in the selection, empty if
+ * there are none, so that whole runs of cells can be tested at once.
+ */
+void
+selspan(int y, int *x1, int *x2)
+{
+	*x1 = *x2 = 0;
+	if (sel.mode == SEL_EMPTY || sel.ob.x == -1 ||
+	    sel.alt != IS_SET(MODE_ALTSCREEN) ||
+	    !BETWEEN(y, sel.nb.y, sel.ne.y))
+		return;
+
+	if (sel.type == SEL_RECTANGULAR) {
+		*x1 = sel.nb.x;
+		*x2 = sel.ne.x + 1;
+	} else {
+		*x1 = (y == sel.nb.y) ? sel.nb.x : 0;
+		*x2 = (y == sel.ne.y) ? sel.ne.x + 1 : INT_MAX;
+	}
 }
 
 void
@@ -609,56 +852,87 @@ selsnap(int *x, int *y, int direction)
 char *
 getsel(void)
 {
-	char *str, *ptr;
-	int y, bufsize, lastx, linelen;
-	const Glyph *gp, *last;
+	char *str;
+	size_t len = 0;
+	int y;
 
 	if (sel.ob.x == -1)
 		return NULL;
 
-	bufsize = (term.col+1) * (sel.ne.y-sel.nb.y+1) * UTF_SIZ;
-	ptr = str = xmalloc(bufsize);
+	/* measured first rather than sized for UTF_SIZ bytes a cell */
+	for (y = sel.nb.y; y <= sel.ne.y; y++)
+		len += getselline(y, NULL);
+	str = xmalloc(len + 1);
+	for (len = 0, y = sel.nb.y; y <= sel.ne.y; y++)
+		len += getselline(y, str + len);
+	str[len] = '\0';
 
-	/* append every set & selected glyph to the selection */
-	for (y = sel.nb.y; y <= sel.ne.y; y++) {
-		if ((linelen = tlinelen(y)) == 0) {
-			*ptr++ = '\n';
-			continue;
-		}
+	return str;
+}
 
-		if (sel.type == SEL_RECTANGULAR) {
-			gp = &TLINE(y)[sel.nb.x];
-			lastx = sel.ne.x;
-		} else {
-			gp = &TLINE(y)[sel.nb.y == y ? sel.nb.x : 0];
-			lastx = (sel.ne.y == y) ? sel.ne.x : term.col-1;
-		}
-		last = &TLINE(y)[MIN(lastx, linelen-1)];
+/*
+ * Writes the selected text of line y to buf, or only counts it if buf is
+ * NULL. Returns its length in bytes.
+ */
+size_t
+getselline(int y, char *buf)
+{
+	char tmp[UTF_SIZ];
+	const Glyph *gp, *last;
+	Line l;
+	int lastx, linelen, wrap;
+	size_t n = 0;
+
+	if ((linelen = tlinelen(y)) == 0) {
+		if (buf)
+			*buf = '\n';
+		return 1;
+	}
+
+	l = TLINE(y);
+	if (sel.type == SEL_RECTANGULAR) {
+		gp = &l[sel.nb.x];
+		lastx = sel.ne.x;
+	} else {
+		gp = &l[sel.nb.y == y ? sel.nb.x : 0];
+		lastx = (sel.ne.y == y) ? sel.ne.x : term.col-1;
+	}
+	last = &l[MIN(lastx, linelen-1)];
+	/* a line wrapped into the next goes on with its spaces */
+	wrap = sel.type != SEL_RECTANGULAR && lastx >= term.col-1 &&
+	       (l[term.col-1].mode & ATTR_WRAP);
+	if (wrap) {
+		if (tpad(last))
+			--last;
+	} else {
 		while (last >= gp && last->u == ' ')
 			--last;
+	}
 
-		for ( ; gp <= last; ++gp) {
-			if (gp->mode & ATTR_WDUMMY)
-				continue;
+	/* append every set & selected glyph to the selection */
+	for ( ; gp <= last; ++gp) {
+		if (gp->mode & ATTR_WDUMMY)
+			continue;
 
-			ptr += utf8encode(gp->u, ptr);
-		}
+		n += utf8encode(gp->u, buf ? buf + n : tmp);
+	}
 
-		/*
-		 * Copy and pasting of line endings is inconsistent
-		 * in the inconsistent terminal and GUI world.
-		 * The best solution seems like to produce '\n' when
-		 * something is copied from st and convert '\n' to
-		 * '\r', when something to be pasted is received by
-		 * st.
-		 * FIXME: Fix the computer world.
-		 */
-		if ((y < sel.ne.y || lastx >= linelen) &&
-		    (!(last->mode & ATTR_WRAP) || sel.type == SEL_RECTANGULAR))
-			*ptr++ = '\n';
+	/*
+	 * Copy and pasting of line endings is inconsistent
+	 * in the inconsistent terminal and GUI world.
+	 * The best solution seems like to produce '\n' when
+	 * something is copied from st and convert '\n' to
+	 * '\r', when something to be pasted is received by
+	 * st.
+	 * FIXME: Fix the computer world.
+	 */
+	if ((y < sel.ne.y || lastx >= linelen) && !wrap) {
+		if (buf)
+			buf[n] = '\n';
+		n++;
 	}
-	*ptr = 0;
-	return str;
+
+	return n;
 }
 
 void
@@ -792,13 +1066,20 @@ ttynew(const char *line, char *cmd, const char *out, char **args)
 		}
 	}
 
+	if (trace.mode >= TRACE_REPLAY) {
+		/* nobody to talk to, answers to the trace go nowhere */
+		if ((cmdfd = open("/dev/null", O_RDWR)) < 0)
+			die("open /dev/null failed: %s\n", strerror(errno));
+		return ttyreaderstart();
+	}
+
 	if (line) {
 		if ((cmdfd = open(line, O_RDWR)) < 0)
 			die("open line '%s' failed: %s\n",
 			    line, strerror(errno));
 		dup2(cmdfd, 0);
 		stty(args);
-		return cmdfd;
+		return ttyreaderstart();
 	}
 
 	/* seems to work fine on linux, openbsd and freebsd */
@@ -836,33 +1117,307 @@ ttynew(const char *line, char *cmd, const char *out, char **args)
 		signal(SIGCHLD, sigchld);
 		break;
 	}
-	return cmdfd;
+	return ttyreaderstart();
+}
+
+/*
+ * Starts the thread reading cmdfd into ttyring. Returns the fd which
+ * becomes readable when there is input for ttyread().
+ */
+int
+ttyreaderstart(void)
+{
+	sigset_t all, old;
+	int i, err;
+
+	ttyring.buf = xmalloc(TTY_RING_SIZ);
+	if (pipe(ttyring.fd) < 0)
+		die("pipe failed: %s\n", strerror(errno));
+	for (i = 0; i < 2; i++) {
+		fcntl(ttyring.fd[i], F_SETFL, O_NONBLOCK);
+		fcntl(ttyring.fd[i], F_SETFD, FD_CLOEXEC);
+	}
+	/* writes which do not fit are queued, see ttywriteraw() */
+	fcntl(cmdfd, F_SETFL, fcntl(cmdfd, F_GETFL) | O_NONBLOCK);
+
+	/* signals are for the main thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	err = pthread_create(&ttyring.thread, NULL, ttyreader, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (err)
+		die("pthread_create failed: %s\n", strerror(err));
+
+	return ttyring.fd[0];
+}
+
+void *
+ttyreader(void *unused)
+{
+	size_t head = 0, i;
+	ssize_t r;
+	fd_set rfd;
+
+	if (trace.mode >= TRACE_REPLAY) {
+		tracereplay();
+		return NULL;
+	}
+
+	for (;;) {
+		i = head % TTY_RING_SIZ;
+		r = read(cmdfd, ttyring.buf + i, ttyringroom(head));
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0 && errno == EAGAIN) {
+			/* cmdfd is non-blocking for ttywriteraw() */
+			FD_ZERO(&rfd);
+			FD_SET(cmdfd, &rfd);
+			pselect(cmdfd + 1, &rfd, NULL, NULL, NULL, NULL);
+			continue;
+		}
+		if (r <= 0) {
+			ttyringclose(r < 0 ? errno : 0);
+			return NULL;
+		}
+		if (trace.mode == TRACE_RECORD)
+			tracewrite(TREC_OUT, ttyring.buf + i, r);
+
+		head += r;
+		ttyringpush(head);
+	}
 }
 
+/*
+ * Waits until the ring has room past head. Returns how much of it is
+ * contiguous.
+ */
+size_t
+ttyringroom(size_t head)
+{
+	size_t tail;
+
+	tail = __atomic_load_n(&ttyring.tail, __ATOMIC_ACQUIRE);
+	if (head - tail == TTY_RING_SIZ) {
+		pthread_mutex_lock(&ttyring.lock);
+		while (head - (tail = __atomic_load_n(&ttyring.tail,
+		       __ATOMIC_ACQUIRE)) == TTY_RING_SIZ)
+			pthread_cond_wait(&ttyring.room, &ttyring.lock);
+		pthread_mutex_unlock(&ttyring.lock);
+	}
+
+	return MIN(TTY_RING_SIZ - (head - tail),
+	           TTY_RING_SIZ - head % TTY_RING_SIZ);
+}
+
+void
+ttyringpush(size_t head)
+{
+	__atomic_store_n(&ttyring.head, head, __ATOMIC_RELEASE);
+	/* a full pipe already has a wakeup pending */
+	xwrite(ttyring.fd[1], "", 1);
+}
+
+void
+ttyringclose(int err)
+{
+	ttyring.err = err;
+	__atomic_store_n(&ttyring.eof, 1, __ATOMIC_RELEASE);
+	xwrite(ttyring.fd[1], "", 1);
+}
+
+/*
+ * Starts recording the session to path, or replaying it from there
+ * instead of running a shell. Call before ttynew().
+ */
+void
+traceopen(const char *path, int mode)
+{
+	char magic[sizeof(TRACE_MAGIC) - 1];
+
+	if (!(trace.fp = fopen(path, (mode == TRACE_RECORD) ? "w" : "r")))
+		die("open trace '%s' failed: %s\n", path, strerror(errno));
+	if (mode == TRACE_RECORD) {
+		fwrite(TRACE_MAGIC, 1, sizeof(magic), trace.fp);
+		fflush(trace.fp);
+	} else if (fread(magic, 1, sizeof(magic), trace.fp) != sizeof(magic)
+	           || memcmp(magic, TRACE_MAGIC, sizeof(magic))) {
+		die("'%s' is not a trace\n", path);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &trace.last);
+	trace.mode = mode;
+}
+
+void
+tracewrite(int type, const char *s, size_t n)
+{
+	struct timespec now;
+	uchar hdr[TRACE_HDR_SIZ];
+	double us;
+
+	pthread_mutex_lock(&trace.lock);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	us = TIMEDIFF(now, trace.last) * 1000;
+	trace.last = now;
+
+	hdr[0] = type;
+	putle32(hdr + 1, MIN(us, UINT32_MAX));
+	putle32(hdr + 5, n);
+	fwrite(hdr, 1, sizeof(hdr), trace.fp);
+	fwrite(s, 1, n, trace.fp);
+	/* the shell exiting ends st with _exit() */
+	fflush(trace.fp);
+	pthread_mutex_unlock(&trace.lock);
+}
+
+/*
+ * Feeds the output records of the trace into the ring, at the recorded
+ * pace for TRACE_REPLAY. Input records are skipped, resizes are handed
+ * to the main thread, which applies them once it has parsed everything
+ * before them.
+ */
+void
+tracereplay(void)
+{
+	uchar hdr[TRACE_HDR_SIZ], sz[4];
+	struct timespec due;
+	size_t head = 0, len, n;
+
+	clock_gettime(CLOCK_MONOTONIC, &due);
+	while (fread(hdr, 1, sizeof(hdr), trace.fp) == sizeof(hdr)) {
+		if (trace.mode == TRACE_REPLAY)
+			tracewait(&due, getle32(hdr + 1));
+		len = getle32(hdr + 5);
+
+		switch (hdr[0]) {
+		case TREC_OUT:
+			for (; len > 0; len -= n) {
+				n = fread(ttyring.buf + head % TTY_RING_SIZ, 1,
+				          MIN(len, ttyringroom(head)), trace.fp);
+				if (n == 0)
+					goto end;
+				head += n;
+				ttyringpush(head);
+			}
+			break;
+		case TREC_RESIZE:
+			if (len != sizeof(sz) || !fread(sz, sizeof(sz), 1, trace.fp))
+				goto end;
+			/*
+			 * ttyread() applies it after parsing up to head, which
+			 * may leave an incomplete UTF-8 sequence unparsed
+			 */
+			__atomic_store_n(&ttyring.resize,
+			                 (sz[0] | sz[1] << 8) << 16 | sz[2] | sz[3] << 8,
+			                 __ATOMIC_RELEASE);
+			xwrite(ttyring.fd[1], "", 1);
+			pthread_mutex_lock(&ttyring.lock);
+			while (__atomic_load_n(&ttyring.resize, __ATOMIC_ACQUIRE))
+				pthread_cond_wait(&ttyring.room, &ttyring.lock);
+			pthread_mutex_unlock(&ttyring.lock);
+			break;
+		default:
+			if (fseek(trace.fp, len, SEEK_CUR) < 0)
+				goto end;
+			break;
+		}
+	}
+end:
+	ttyringclose(ferror(trace.fp) ? EIO : 0);
+}
+
+void
+tracewait(struct timespec *due, uint32_t us)
+{
+	struct timespec now, d;
+
+	due->tv_sec += us / 1000000;
+	due->tv_nsec += us % 1000000 * 1000;
+	if (due->tv_nsec >= 1000000000) {
+		due->tv_sec++;
+		due->tv_nsec -= 1000000000;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	d.tv_sec = due->tv_sec - now.tv_sec;
+	d.tv_nsec = due->tv_nsec - now.tv_nsec;
+	if (d.tv_nsec < 0) {
+		d.tv_sec--;
+		d.tv_nsec += 1000000000;
+	}
+	if (d.tv_sec >= 0)
+		nanosleep(&d, NULL);
+}
+
+uint32_t
+getle32(const uchar *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+void
+putle32(uchar *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+/*
+ * Parses everything the reader thread has buffered so far in one batch.
+ * Returns the number of bytes consumed.
+ */
 size_t
 ttyread(void)
 {
-	static char buf[BUFSIZ];
-	static int buflen = 0;
-	int ret, written;
+	char seam[2 * UTF_SIZ], wake[64];
+	size_t head, tail, start, i, len, n;
+	int eof, resize;
 
-	/* append read bytes to unprocessed bytes */
-	ret = read(cmdfd, buf+buflen, LEN(buf)-buflen);
+	while (read(ttyring.fd[0], wake, sizeof(wake)) > 0)
+		;
 
-	switch (ret) {
-	case 0:
-		exit(0);
-	case -1:
-		die("couldn't read from shell: %s\n", strerror(errno));
-	default:
-		buflen += ret;
-		written = twrite(buf, buflen, 0);
-		buflen -= written;
+	/* a replayed resize comes after what is in the ring, which stays put */
+	resize = __atomic_load_n(&ttyring.resize, __ATOMIC_ACQUIRE);
+	eof = __atomic_load_n(&ttyring.eof, __ATOMIC_ACQUIRE);
+	head = __atomic_load_n(&ttyring.head, __ATOMIC_ACQUIRE);
+	start = tail = ttyring.tail;
+
+	while (tail != head) {
+		i = tail % TTY_RING_SIZ;
+		len = tcolroom(MIN(head - tail, TTY_RING_SIZ - i));
+		n = twrite(ttyring.buf + i, len, 0);
+		if (n == 0 && i + len == TTY_RING_SIZ && head - tail > len) {
+			/* a UTF-8 sequence split by the end of the ring */
+			n = MIN(head - tail, sizeof(seam));
+			memcpy(seam, ttyring.buf + i, len);
+			memcpy(seam + len, ttyring.buf, n - len);
+			n = twrite(seam, n, 0);
+		}
 		/* keep any incomplete UTF-8 byte sequence for the next call */
-		if (buflen > 0)
-			memmove(buf, buf + written, buflen);
-		return ret;
+		if (n == 0)
+			break;
+		tail += n;
+	}
+
+	if (resize)
+		xsetsize(resize >> 16, resize & 0xffff);
+	if (tail != start || resize) {
+		pthread_mutex_lock(&ttyring.lock);
+		__atomic_store_n(&ttyring.tail, tail, __ATOMIC_RELEASE);
+		if (resize)
+			__atomic_store_n(&ttyring.resize, 0, __ATOMIC_RELEASE);
+		pthread_cond_signal(&ttyring.room);
+		pthread_mutex_unlock(&ttyring.lock);
+	}
+	if (eof && head - tail < UTF_SIZ) {
+		if (ttyring.err)
+			die("couldn't read from shell: %s\n",
+			    strerror(ttyring.err));
+		exit(0);
 	}
+
+	return tail - start;
 }
 
 void
@@ -871,6 +1426,9 @@ ttywrite(const char *s, size_t n, int may_echo)
 	const char *next;
 	Arg arg = (Arg) { .i = term.scr };
 
+	if (trace.mode == TRACE_RECORD)
+		tracewrite(TREC_IN, s, n);
+
 	kscrolldown(&arg);
 
 	if (may_echo && IS_SET(MODE_ECHO))
@@ -896,67 +1454,87 @@ ttywrite(const char *s, size_t n, int may_echo)
 	}
 }
 
+/*
+ * Writes what fits into the pty right away and queues the rest behind
+ * what is queued already, so that big pastes never block the main loop.
+ */
 void
 ttywriteraw(const char *s, size_t n)
 {
-	fd_set wfd, rfd;
 	ssize_t r;
-	size_t lim = 256;
 
-	/*
-	 * Remember that we are using a pty, which might be a modem line.
-	 * Writing too much will clog the line. That's why we are doing this
-	 * dance.
-	 * FIXME: Migrate the world to Plan 9.
-	 */
-	while (n > 0) {
-		FD_ZERO(&wfd);
-		FD_ZERO(&rfd);
-		FD_SET(cmdfd, &wfd);
-		FD_SET(cmdfd, &rfd);
-
-		/* Check if we can write. */
-		if (pselect(cmdfd+1, &rfd, &wfd, NULL, NULL, NULL) < 0) {
-			if (errno == EINTR)
-				continue;
-			die("select failed: %s\n", strerror(errno));
+	if (ttyqueue.len == 0) {
+		while ((r = write(cmdfd, s, n)) < 0 && errno == EINTR)
+			;
+		if (r < 0 && errno != EAGAIN)
+			die("write error on tty: %s\n", strerror(errno));
+		if (r > 0) {
+			s += r;
+			n -= r;
 		}
-		if (FD_ISSET(cmdfd, &wfd)) {
-			/*
-			 * Only write the bytes written by ttywrite() or the
-			 * default of 256. This seems to be a reasonable value
-			 * for a serial line. Bigger values might clog the I/O.
-			 */
-			if ((r = write(cmdfd, s, (n < lim)? n : lim)) < 0)
-				goto write_error;
-			if (r < n) {
-				/*
-				 * We weren't able to write out everything.
-				 * This means the buffer is getting full
-				 * again. Empty it.
-				 */
-				if (n < lim)
-					lim = ttyread();
-				n -= r;
-				s += r;
-			} else {
-				/* All bytes have been written. */
-				break;
-			}
+	}
+	if (n == 0)
+		return;
+
+	if (ttyqueue.len + n > ttyqueue.cap) {
+		/* move the part left to the front first */
+		memmove(ttyqueue.buf, ttyqueue.buf + ttyqueue.off,
+		        ttyqueue.len - ttyqueue.off);
+		ttyqueue.len -= ttyqueue.off;
+		ttyqueue.off = 0;
+		if (ttyqueue.len + n > ttyqueue.cap) {
+			ttyqueue.cap = MAX(2 * ttyqueue.cap, ttyqueue.len + n);
+			ttyqueue.buf = xrealloc(ttyqueue.buf, ttyqueue.cap);
 		}
-		if (FD_ISSET(cmdfd, &rfd))
-			lim = ttyread();
 	}
-	return;
+	memcpy(ttyqueue.buf + ttyqueue.len, s, n);
+	ttyqueue.len += n;
+}
+
+/* Returns the fd to wait on before ttyflush(), -1 if nothing is queued. */
+int
+ttywritefd(void)
+{
+	return ttyqueue.len > 0 ? cmdfd : -1;
+}
+
+/* Writes out as much of the queued pty output as fits. */
+void
+ttyflush(void)
+{
+	ssize_t r;
+
+	while (ttyqueue.off < ttyqueue.len) {
+		r = write(cmdfd, ttyqueue.buf + ttyqueue.off,
+		          ttyqueue.len - ttyqueue.off);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0 && errno == EAGAIN)
+			return;
+		if (r < 0)
+			die("write error on tty: %s\n", strerror(errno));
+		ttyqueue.off += r;
+	}
 
-write_error:
-	die("write error on tty: %s\n", strerror(errno));
+	/* all out, do not keep a big paste around */
+	ttyqueue.off = ttyqueue.len = 0;
+	if (ttyqueue.cap > BUFSIZ) {
+		free(ttyqueue.buf);
+		ttyqueue.buf = NULL;
+		ttyqueue.cap = 0;
+	}
 }
 
 void
 ttyresize(int tw, int th)
 {
 	struct winsize w;
+	uchar sz[4] = { term.col, term.col >> 8, term.row, term.row >> 8 };
+
+	if (trace.mode == TRACE_RECORD)
+		tracewrite(TREC_RESIZE, (char *)sz, sizeof(sz));
+	else if (trace.mode >= TRACE_REPLAY)
+		return;
 
 	w.ws_row = term.row;
 	w.ws_col = term.col;
@@ -988,6 +1566,16 @@ tattrset(int attr)
 	return 0;
 }
 
+/*
+ * Screens' worth of lines scrolled by since the last draw(): anything
+ * drawn now would be gone before the next frame.
+ */
+int
+tscrolled(void)
+{
+	return term.scrolled / term.row;
+}
+
 void
 tsetdirt(int top, int bot)
 {
@@ -1018,20 +1606,20 @@ tsetdirtattr(int attr)
 void
 tfulldirt(void)
 {
+	term.blitn = 0;
 	tsetdirt(0, term.row-1);
 }
 
 void
 tcursor(int mode)
 {
-	static TCursor c[2];
 	int alt = IS_SET(MODE_ALTSCREEN);
 
 	if (mode == CURSOR_SAVE) {
-		c[alt] = term.c;
+		term.saved[alt] = term.c;
 	} else if (mode == CURSOR_LOAD) {
-		term.c = c[alt];
-		tmoveto(c[alt].x, c[alt].y);
+		term.c = term.saved[alt];
+		tmoveto(term.saved[alt].x, term.saved[alt].y);
 	}
 }
 
@@ -1042,8 +1630,7 @@ treset(void)
 
 	term.c = (TCursor){{
 		.mode = ATTR_NULL,
-		.fg = defaultfg,
-		.bg = defaultbg
+		.col = tcolpair(defaultfg, defaultbg)
 	}, .x = 0, .y = 0, .state = CURSOR_DEFAULT};
 
 	memset(term.tabs, 0, term.col * sizeof(*term.tabs));
@@ -1066,7 +1653,8 @@ treset(void)
 void
 tnew(int col, int row)
 {
-	term = (Term){ .c = { .attr = { .fg = defaultfg, .bg = defaultbg } } };
+	term = (Term){ .c = { .attr = { .col = tcolpair(defaultfg,
+	                                                defaultbg) } } };
 	tresize(col, row);
 	treset();
 }
@@ -1075,9 +1663,12 @@ void
 tswapscreen(void)
 {
 	Line *tmp = term.line;
+	ScreenBuf b = term.linebuf;
 
 	term.line = term.alt;
 	term.alt = tmp;
+	term.linebuf = term.altbuf;
+	term.altbuf = b;
 	term.mode ^= MODE_ALTSCREEN;
 	tfulldirt();
 }
@@ -1094,9 +1685,11 @@ kscrolldown(const Arg* a)
 		n = term.scr;
 
 	if (term.scr > 0) {
+		tscrollview(n);
 		term.scr -= n;
 		selscroll(0, -n);
-		tfulldirt();
+		if (term.histnthaw)
+			thistsweep();
 	}
 }
 
@@ -1108,35 +1701,1010 @@ kscrollup(const Arg* a)
 	if (n < 0)
 		n = term.row + n;
 
-	if (term.scr <= HISTSIZE-n) {
+	/* lines at an older width are rewrapped before they show */
+	if (term.scr + n > term.histn - term.histnstale)
+		thistrewrap();
+	n = MIN(n, term.histn - term.scr);
+	if (n > 0) {
+		tscrollview(-n);
 		term.scr += n;
 		selscroll(0, n);
-		tfulldirt();
+		if (term.histnthaw)
+			thistsweep();
+	}
+}
+
+/*
+ * Looks for query from the match selected by the previous search, or the
+ * bottom of the view, towards older lines (dir > 0) or newer ones
+ * (dir < 0). dir 0 is for a query being typed and accepts the current
+ * match again. The match found is scrolled into view and selected.
+ * Lines soft-wrapped into the next are searched as one with it.
+ * Matching ignores case unless the query has capitals. Returns 0 if there
+ * is no match, leaving everything as it was.
+ */
+int
+tsearch(const char *query, int dir)
+{
+	static Rune *q;
+	static int qcap;
+	uint64_t tri[HIST_TRIBITS / 64] = { 0 }, ltri[HIST_TRIBITS / 64];
+	HistLine *h;
+	Arg arg;
+	Rune *u;
+	int *cx, fold = 1, qn, i, j, k, n, s = -1, x, y, a, b, e, x0, x1, y1;
+	size_t len = strlen(query), d;
+
+	if (qcap < len) {
+		qcap = len;
+		q = xrealloc(q, qcap * sizeof(Rune));
+	}
+	for (qn = 0; len > 0; qn++, query += d, len -= d) {
+		if (!(d = utf8decode(query, &q[qn], len)))
+			break;
+		if (iswupper(q[qn]))
+			fold = 0;
+	}
+	if (qn == 0) {
+		selclear();
+		return 1;
+	}
+	for (k = 2; k < qn; k++) {
+		j = trihash(towlower(q[k-2]), towlower(q[k-1]), towlower(q[k]));
+		tri[j / 64] |= (uint64_t)1 << j % 64;
+	}
+	if (fold) {
+		for (k = 0; k < qn; k++)
+			q[k] = towlower(q[k]);
+	}
+	thistrewrap();
+
+	if (sel.ob.x != -1 && sel.type == SEL_REGULAR) {
+		i = term.histn - term.scr + sel.nb.y;
+		x = sel.nb.x;
+	} else {
+		i = term.histn - term.scr + term.row - 1;
+		x = term.col;
+	}
+
+	/* lines a to b, joined where they wrap */
+	for (k = i; k >= 0 && k < term.histn + term.row;
+	     k = dir < 0 ? b + 1 : a - 1) {
+		/* past the first, k is where one of them ends */
+		a = b = k;
+		if (dir >= 0 || k == i) {
+			for (; a > 0 &&
+			     (tlinemode(a - 1, term.col - 1) & ATTR_WRAP); a--)
+				;
+		}
+		if (dir < 0 || k == i) {
+			for (; b < term.histn + term.row - 1 &&
+			     (tlinemode(b, term.col - 1) & ATTR_WRAP); b++)
+				;
+		}
+		/*
+		 * thistindex() files the trigrams across a wrap under the
+		 * line after it, which misses some below four columns
+		 */
+		if (b < term.histn && term.col >= 4) {
+			memset(ltri, 0, sizeof(ltri));
+			for (j = a; j <= b; j++) {
+				h = &term.hist[(term.histi - term.histn + 1 +
+				                j + term.histcap) % term.histcap];
+				for (d = 0; d < LEN(tri); d++)
+					ltri[d] |= h->tri[d];
+			}
+			for (j = 0; j < LEN(tri) && (ltri[j] & tri[j]) == tri[j];
+			     j++)
+				;
+			if (j < LEN(tri))
+				continue;
+		}
+
+		n = tsearchtext(a, b, fold, &u, &cx);
+		x0 = (i - a) * term.col + x;
+		for (s = dir < 0 ? 0 : n - qn; s >= 0 && s <= n - qn;
+		     s += dir < 0 ? 1 : -1) {
+			if (a <= i && i <= b &&
+			    (dir < 0 ? cx[s] <= x0 :
+			     dir > 0 ? cx[s] >= x0 : cx[s] > x0))
+				continue;
+			for (j = 0; j < qn && u[s + j] == q[j]; j++)
+				;
+			if (j == qn)
+				break;
+		}
+		if (s >= 0 && s <= n - qn)
+			break;
+	}
+	if (!(k >= 0 && k < term.histn + term.row))
+		return 0;
+
+	selclear();
+	k = a + cx[s] / term.col;
+	e = a + cx[s + qn - 1] / term.col;
+	y = k - term.histn + term.scr;
+	if (y < 0 || y >= term.row) {
+		/* bring it to the middle of the screen */
+		n = term.histn - k + term.row / 2;
+		LIMIT(n, 0, term.histn);
+		if (n > term.scr) {
+			arg.i = n - term.scr;
+			kscrollup(&arg);
+		} else {
+			arg.i = term.scr - n;
+			kscrolldown(&arg);
+		}
+		y = k - term.histn + term.scr;
+	}
+	y1 = y + e - k;
+	x1 = cx[s + qn - 1] % term.col;
+	/* a match wrapped over more lines than the screen has */
+	if (y1 >= term.row) {
+		y1 = term.row - 1;
+		x1 = term.col - 1;
+	}
+	selstart(cx[s] % term.col, y, 0);
+	selextend(x1, y1, SEL_REGULAR, 0);
+	selextend(x1, y1, SEL_REGULAR, 1);
+
+	return 1;
+}
+
+/*
+ * Decodes lines i to j, counting from the oldest history line, into runes
+ * and the cells they start at, without unpacking them. The lines before j
+ * wrap into the next one and are read as one with it, their cells
+ * counting on from term.col. Wide glyph dummies, the padding in front of
+ * a wide glyph moved down and the blanks after the text are left out.
+ * Returns the number of runes.
+ */
+int
+tsearchtext(int i, int j, int fold, Rune **u, int **cx)
+{
+	static Rune *runes;
+	static int *cells, cap;
+	const PackedLine *p = NULL;
+	const AttrRun *run;
+	const char *t, *end;
+	HistLine *h;
+	Line l;
+	Rune r;
+	int k, x, n, o, len, fill, w;
+
+	if (cap < (j - i + 1) * term.col) {
+		cap = (j - i + 1) * term.col;
+		runes = xrealloc(runes, cap * sizeof(*runes));
+		cells = xrealloc(cells, cap * sizeof(*cells));
+	}
+	*u = runes;
+	*cx = cells;
+
+	for (n = 0, k = i; k <= j; k++) {
+		o = (k - i) * term.col;
+		w = term.col;
+		if (k >= term.histn) {
+			l = term.line[k - term.histn];
+		} else {
+			h = &term.hist[(term.histi - term.histn + 1 + k +
+			                term.histcap) % term.histcap];
+			l = h->line;
+			p = h->packed;
+			w = MIN(h->col, w);
+		}
+
+		if (l) {
+			if (k < j) {
+				len = w;
+				if (tpad(&l[w - 1]) &&
+				    (tlinemode(k + 1, 0) & ATTR_WIDE))
+					len--;
+			} else {
+				for (len = w; len > 0 && l[len - 1].u == ' ';
+				     len--)
+					;
+			}
+			for (x = 0; x < len; x++) {
+				if (l[x].mode & ATTR_WDUMMY)
+					continue;
+				runes[n] = fold ? towlower(l[x].u) : l[x].u;
+				cells[n++] = o + x;
+			}
+			continue;
+		}
+
+		/* the spaces after the text only count when wrapped */
+		fill = 0;
+		if (k < j) {
+			fill = w;
+			for (run = p->run, x = w - 1; x >= run->n; run++)
+				x -= run->n;
+			if (p->len < w && !(run->mode & ~ATTR_WRAP) &&
+			    run->fg == defaultbg && run->bg == defaultbg &&
+			    (tlinemode(k + 1, 0) & ATTR_WIDE))
+				fill--;
+		}
+		t = (const char *)&p->run[p->nrun];
+		end = t + p->ntext;
+		len = MIN(p->len, w);
+		for (x = 0; x < len && t < end; x++) {
+			if ((uchar)*t < 0x80)
+				r = *t++;
+			else
+				t += utf8decode(t, &r, end - t);
+			/* the dummy after a wide glyph */
+			if (r == 0)
+				continue;
+			runes[n] = fold ? towlower(r) : r;
+			cells[n++] = o + x;
+		}
+		for (; x < fill; x++) {
+			runes[n] = ' ';
+			cells[n++] = o + x;
+		}
+	}
+
+	return n;
+}
+
+/*
+ * The mode of cell x of line k, counting from the oldest history line,
+ * without unpacking it.
+ */
+int
+tlinemode(int k, int x)
+{
+	HistLine *h;
+
+	if (k >= term.histn)
+		return term.line[k - term.histn][x].mode;
+	h = &term.hist[(term.histi - term.histn + 1 + k + term.histcap) %
+	               term.histcap];
+	if (x >= h->col)
+		return 0;
+
+	return h->line ? h->line[x].mode : packedmode(h->packed, x);
+}
+
+/*
+ * Returns the n-th newest history line, unpacking it if it is cold and
+ * widening it if the terminal grew past the width it was stored with.
+ */
+Line
+thist(int n)
+{
+	int i = (term.histi - n + term.histcap) % term.histcap, x;
+	HistLine *h = &term.hist[i];
+
+	if (!h->line)
+		thistunpack(i);
+	if (h->col < term.col) {
+		h->line = xrealloc(h->line, term.maxcol * sizeof(Glyph));
+		for (x = h->col; x < term.maxcol; x++) {
+			h->line[x] = (Glyph){ .u = ' ',
+			                      .col = tcolpair(defaultfg,
+			                                      defaultbg) };
+		}
+		h->col = term.maxcol;
+	}
+
+	return h->line;
+}
+
+/*
+ * Moves screen line y into the history. Until histsize lines are stored
+ * the ring is grown and y gets a freshly allocated line; after that the
+ * oldest history line is recycled for it.
+ */
+void
+thistpush(int y)
+{
+	Glyph blank = { .u = ' ', .col = tcolpair(defaultfg, defaultbg) };
+	HistLine *h;
+	Line l, prev;
+	int x, from;
+
+	if (histsize == 0)
+		return;
+
+	/* the newest line, which this one may continue */
+	prev = NULL;
+	if (term.histn > 0 && term.histcap > 1 &&
+	    term.hist[term.histi].col >= term.col)
+		prev = term.hist[term.histi].line;
+
+	if (term.histn < histsize) {
+		if (term.histn == term.histcap) {
+			term.histcap = MIN(MAX(2 * term.histcap, HIST_MINCAP),
+			                   histsize);
+			term.hist = xrealloc(term.hist,
+			                     term.histcap * sizeof(*term.hist));
+			memset(&term.hist[term.histn], 0, (term.histcap -
+			       term.histn) * sizeof(*term.hist));
+		}
+		term.histi = term.histn++;
+		h = &term.hist[term.histi];
+		l = xmalloc(term.maxcol * sizeof(Glyph));
+		from = 0;
+	} else {
+		term.histi = (term.histi + 1) % term.histcap;
+		h = &term.hist[term.histi];
+		l = h->line;
+		from = l ? h->col : 0;
+		if (from < term.maxcol)
+			l = xrealloc(l, term.maxcol * sizeof(Glyph));
+		free(h->packed);
+		h->packed = NULL;
+		/* the oldest line is gone, maybe a stale one */
+		if (term.histnstale > 0)
+			term.histnstale--;
+	}
+
+	/*
+	 * The row stays on the screen to be cleared by our callers, but only
+	 * up to term.col. What is left past it is not kept, treflow() would
+	 * bring it back.
+	 */
+	memcpy(l, term.line[y], term.col * sizeof(Glyph));
+	for (x = term.col; x < term.maxcol; x++)
+		l[x] = term.line[y][x] = blank;
+
+	h->line = l;
+	h->col = term.maxcol;
+	thistindex(h, prev, term.col);
+
+	if (term.histn > HIST_HOT) {
+		thistpack(&term.hist[(term.histi - HIST_HOT + term.histcap)
+		                     % term.histcap]);
+	}
+	if (term.histnthaw)
+		thistsweep();
+}
+
+/*
+ * Fills the trigram filter of a history line: a bit for every three glyphs
+ * in a row, folded to lower case. tsearch() skips the lines missing any
+ * bit of its query without looking at their text. If prev, the line
+ * before it w cells wide, wraps into it, the trigrams starting in prev
+ * and ending in this line count too.
+ */
+void
+thistindex(HistLine *h, const Glyph *prev, int w)
+{
+	Rune a = 0, b = 0, c;
+	int x, n = 0, j;
+
+	if (prev && (prev[w - 1].mode & ATTR_WRAP)) {
+		x = w;
+		if (tpad(&prev[x - 1]) && (h->line[0].mode & ATTR_WIDE))
+			x--;
+		for (; x > 0 && n < 2; x--) {
+			if (prev[x - 1].mode & ATTR_WDUMMY)
+				continue;
+			c = towlower(prev[x - 1].u);
+			if (n++ == 0)
+				b = c;
+			else
+				a = c;
+		}
+	}
+
+	memset(h->tri, 0, sizeof(h->tri));
+	for (x = 0; x < h->col; x++) {
+		if (h->line[x].mode & ATTR_WDUMMY)
+			continue;
+		c = towlower(h->line[x].u);
+		if (++n >= 3) {
+			j = trihash(a, b, c);
+			h->tri[j / 64] |= (uint64_t)1 << j % 64;
+		}
+		a = b;
+		b = c;
+	}
+}
+
+uint
+trihash(Rune a, Rune b, Rune c)
+{
+	/* the top 8 bits, one of HIST_TRIBITS */
+	return (uint32_t)(a * 0x9E3779B1u ^ b * 0x85EBCA77u ^
+	                  c * 0xC2B2AE3Du) >> 24;
+}
+
+/*
+ * Drops the glyphs of a history line, keeping only its packed form:
+ * attribute runs over the whole width and UTF-8 text up to the last
+ * non-space cell.
+ */
+void
+thistpack(HistLine *h)
+{
+	static AttrRun *runs;
+	static char *text;
+	static int cap;
+	PackedLine *p;
+	AttrRun *r = NULL;
+	const Glyph *g;
+	Line l = h->line;
+	char *t;
+	int x, len, ntext;
+	uint32_t col = 0;
+
+	if (!l)
+		return;
+
+	if (!h->packed) {
+		if (cap < h->col) {
+			cap = h->col;
+			runs = xrealloc(runs, (cap + cap / USHRT_MAX + 1) *
+			                sizeof(*runs));
+			text = xrealloc(text, cap * UTF_SIZ);
+		}
+
+		for (len = ntext = 0, t = text, x = 0; x < h->col; x++) {
+			g = &l[x];
+			/* runs keep the colours themselves, not the pair */
+			if (!r || r->n == USHRT_MAX || r->mode != g->mode ||
+			    col != g->col) {
+				r = r ? r + 1 : runs;
+				*r = (AttrRun){ .mode = g->mode,
+				                .fg = glyphfg(g), .bg = glyphbg(g) };
+				col = g->col;
+			}
+			r->n++;
+
+			if (g->u < 0x80)
+				*t++ = g->u;
+			else
+				t += utf8encode(g->u, t);
+			if (g->u != ' ') {
+				len = x + 1;
+				ntext = t - text;
+			}
+		}
+
+		p = xmalloc(sizeof(*p) + (r - runs + 1) * sizeof(*r) + ntext);
+		p->col = h->col;
+		p->len = len;
+		p->nrun = r - runs + 1;
+		p->ntext = ntext;
+		memcpy(p->run, runs, p->nrun * sizeof(*r));
+		memcpy(&p->run[p->nrun], text, ntext);
+		h->packed = p;
+	}
+
+	free(l);
+	h->line = NULL;
+	h->col = h->packed->col;
+}
+
+Line
+thistglyphs(const PackedLine *p)
+{
+	const AttrRun *r;
+	const char *t, *end;
+	Line l;
+	Rune u;
+	uint32_t col;
+	int x, k;
+
+	l = xmalloc(p->col * sizeof(Glyph));
+	t = (const char *)&p->run[p->nrun];
+	end = t + p->ntext;
+	for (x = 0, r = p->run; r < &p->run[p->nrun]; r++) {
+		col = tcolpair(r->fg, r->bg);
+		for (k = 0; k < r->n; k++, x++) {
+			if (x >= p->len)
+				u = ' ';
+			else if ((uchar)*t < 0x80)
+				u = *t++;
+			else
+				t += utf8decode(t, &u, end - t);
+			l[x] = (Glyph){ .u = u, .mode = r->mode, .col = col };
+		}
+	}
+
+	return l;
+}
+
+void
+thistunpack(int i)
+{
+	HistLine *h = &term.hist[i];
+
+	h->line = thistglyphs(h->packed);
+	h->col = h->packed->col;
+
+	if (term.histnthaw == term.histthawcap) {
+		term.histthawcap = MAX(2 * term.histthawcap, 64);
+		term.histthaw = xrealloc(term.histthaw,
+		                         term.histthawcap * sizeof(int));
+	}
+	term.histthaw[term.histnthaw++] = i;
+}
+
+/*
+ * Packs again the history lines unpacked by thist() which are not in view.
+ * Only called where nobody holds on to history lines.
+ */
+void
+thistsweep(void)
+{
+	HistLine *h;
+	int i, j, n;
+
+	for (i = j = 0; i < term.histnthaw; i++) {
+		h = &term.hist[term.histthaw[i]];
+		/* recycled for a newer line or already packed again */
+		if (!h->packed || !h->line)
+			continue;
+		n = (term.histi - term.histthaw[i] + term.histcap)
+		    % term.histcap;
+		if (BETWEEN(n, term.scr - term.row, term.scr - 1)) {
+			term.histthaw[j++] = term.histthaw[i];
+			continue;
+		}
+		thistpack(h);
+	}
+	term.histnthaw = j;
+}
+
+/* Packs again all history lines unpacked by thist(), in view or not */
+void
+thistfreeze(void)
+{
+	HistLine *h;
+	int i;
+
+	for (i = 0; i < term.histnthaw; i++) {
+		h = &term.hist[term.histthaw[i]];
+		if (h->packed && h->line)
+			thistpack(h);
+	}
+	term.histnthaw = 0;
+}
+
+/*
+ * Puts n lines after the stale history lines in place of the rest of the
+ * history, which the caller has used up. The oldest lines past histsize
+ * go. Below histsize the ring has to start at 0 again, see thistpush().
+ */
+void
+thistsplice(HistLine *out, int n)
+{
+	HistLine *hist, *h;
+	int cap = term.histcap, start = 0, drop, total, k;
+
+	if (cap > 0)
+		start = (term.histi - term.histn + 1 + cap) % cap;
+	drop = MAX(term.histnstale + n - (int)histsize, 0);
+	for (k = 0; k < drop; k++) {
+		h = (k < term.histnstale) ? &term.hist[(start + k) % cap]
+		                          : &out[k - term.histnstale];
+		free(h->line);
+		free(h->packed);
+	}
+	k = MIN(drop, term.histnstale);
+	if (cap > 0)
+		start = (start + k) % cap;
+	term.histnstale -= k;
+	out += drop - k;
+	n -= drop - k;
+	total = term.histnstale + n;
+
+	if (total > cap || (start > 0 && total < (int)histsize)) {
+		cap = MAX(total, cap);
+		hist = xmalloc(cap * sizeof(*hist));
+		for (k = 0; k < term.histnstale; k++)
+			hist[k] = term.hist[(start + k) % term.histcap];
+		free(term.hist);
+		term.hist = hist;
+		term.histcap = cap;
+		start = 0;
+	}
+	for (k = 0; k < n; k++)
+		term.hist[(start + term.histnstale + k) % cap] = out[k];
+	if (start == 0 && total < cap) {
+		memset(&term.hist[total], 0, (cap - total) *
+		       sizeof(*term.hist));
+	}
+	term.histn = total;
+	term.histi = (cap > 0) ? (start + MAX(total - 1, 0)) % cap : 0;
+}
+
+/*
+ * Rewraps the history lines treflow() left at an older width to the width
+ * of the terminal. Called before anything reads them; as they are the
+ * oldest lines, counting from the newest one does not change.
+ */
+void
+thistrewrap(void)
+{
+	HistLine *out, *hist;
+	int start, nout, n, drop, total, cap, k;
+
+	if (!term.histnstale)
+		return;
+
+	thistfreeze();
+	out = trewrap(0, term.histnstale, term.histcol, term.col, &nout,
+	              NULL, NULL, NULL);
+
+	/* in front of the other lines, the oldest past histsize go */
+	n = term.histn - term.histnstale;
+	drop = MAX(nout + n - (int)histsize, 0);
+	for (k = 0; k < drop; k++) {
+		free(out[k].line);
+		free(out[k].packed);
+	}
+	total = nout - drop + n;
+	cap = MAX(total, term.histcap);
+	hist = xmalloc(cap * sizeof(*hist));
+	memcpy(hist, &out[drop], (nout - drop) * sizeof(*hist));
+	start = (term.histi - term.histn + 1 + term.histcap) % term.histcap;
+	for (k = 0; k < n; k++) {
+		hist[nout - drop + k] = term.hist[(start + term.histnstale + k)
+		                                  % term.histcap];
+	}
+	memset(&hist[total], 0, (cap - total) * sizeof(*hist));
+	for (k = 0; k < MIN(nout - drop, total - HIST_HOT); k++)
+		thistpack(&hist[k]);
+	free(out);
+	free(term.hist);
+
+	term.hist = hist;
+	term.histcap = cap;
+	term.histn = total;
+	term.histi = MAX(total - 1, 0);
+	term.histnstale = 0;
+	term.histnthaw = 0;
+}
+
+/*
+ * A space showing nothing but the default background, which the end of a
+ * line can do without.
+ */
+int
+tblank(const Glyph *g)
+{
+	return g->u == ' ' && !(g->mode & ~(ATTR_WRAP|ATTR_LIGA)) &&
+	       glyphbg(g) == defaultbg;
+}
+
+/* The blank trewrap() leaves in front of a wide glyph it moved down */
+int
+tpad(const Glyph *g)
+{
+	return g->u == ' ' && !(g->mode & ~ATTR_WRAP) &&
+	       g->col == tcolpair(defaultbg, defaultbg);
+}
+
+/*
+ * Line i of the primary screen counting from the oldest history line.
+ * Returns how many of its first ocol cells are in use and whether it is
+ * soft-wrapped at ocol, without unpacking cold history lines.
+ */
+int
+treflowlen(int i, int ocol, int *wrap)
+{
+	const PackedLine *p;
+	const AttrRun *r;
+	HistLine *h;
+	Line l;
+	int x, w;
+
+	if (i < term.histn) {
+		h = &term.hist[(term.histi - term.histn + 1 + i +
+		                term.histcap) % term.histcap];
+		if (!h->line) {
+			p = h->packed;
+			*wrap = 0;
+			w = MIN(p->len, ocol);
+			for (x = 0, r = p->run; r < &p->run[p->nrun] && x < ocol;
+			     x += r->n, r++) {
+				if (ocol <= x + r->n)
+					*wrap = r->mode & ATTR_WRAP;
+				/* blanks with attributes are kept too */
+				if ((r->mode & ~(ATTR_WRAP|ATTR_LIGA)) ||
+				    r->bg != defaultbg)
+					w = MAX(w, MIN(x + r->n, ocol));
+			}
+			return w;
+		}
+		l = h->line;
+		w = h->col;
+	} else {
+		l = IS_SET(MODE_ALTSCREEN) ? term.alt[i - term.histn]
+		                            : term.line[i - term.histn];
+		w = term.maxcol;
+	}
+
+	*wrap = ocol <= w && (l[ocol - 1].mode & ATTR_WRAP);
+	for (w = MIN(w, ocol); w > 0 && tblank(&l[w - 1]); w--)
+		;
+	return w;
+}
+
+Line
+treflowline(int i)
+{
+	int j;
+
+	if (i >= term.histn) {
+		return IS_SET(MODE_ALTSCREEN) ? term.alt[i - term.histn]
+		                              : term.line[i - term.histn];
+	}
+	j = (term.histi - term.histn + 1 + i + term.histcap) % term.histcap;
+	if (!term.hist[j].line)
+		thistunpack(j);
+	return term.hist[j].line;
+}
+
+/*
+ * Rewraps lines from up to to, counting from the oldest history line, from
+ * ocol to col columns: lines soft-wrapped with ATTR_WRAP are joined into
+ * logical lines and broken again at the new width. Lines which are not
+ * wrapped and still fit are moved over as they are, without looking at
+ * their glyphs. Returns the *nout new lines; the history lines of the
+ * range are used up. With top, *top and *cy get where the first line of
+ * the screen and the cursor land, *cx the column of the cursor.
+ */
+HistLine *
+trewrap(int from, int to, int ocol, int col, int *nout, int *top, int *cy,
+        int *cx)
+{
+	Glyph blank = { .u = ' ', .col = tcolpair(defaultfg, defaultbg) };
+	/* left in front of a wide glyph, no SGR gives this foreground */
+	Glyph pad = { .u = ' ', .col = tcolpair(defaultbg, defaultbg) };
+	TCursor *c = IS_SET(MODE_ALTSCREEN) ? &term.saved[0] : &term.c;
+	HistLine *out = NULL, *h;
+	Glyph *buf = NULL;
+	Line l;
+	int maxcol = MAX(col, term.maxcol);
+	int tidx = top ? term.histn : -1;
+	int cidx = top ? term.histn + MIN(c->y, term.row - 1) : -1;
+	int outcap = 0, bufcap = 0;
+	int i, j, k, n, o, x, end, len, wrap, last, topofs, curofs;
+
+	*nout = 0;
+	if (top)
+		*top = *cy = *cx = 0;
+	for (i = from; i < to; i = j + 1) {
+		for (j = i; ; j++) {
+			len = treflowlen(j, ocol, &wrap);
+			if (!wrap || j == to - 1)
+				break;
+		}
+
+		if (*nout + (j - i + 1) * (ocol / col + 1) + 1 > outcap) {
+			outcap = MAX(2 * outcap, *nout + (j - i + 1) *
+			             (ocol / col + 1) + 1);
+			out = xrealloc(out, outcap * sizeof(*out));
+		}
+
+		/* a lone line that fits: keep it, cold or not */
+		if (i == j && !wrap && len <= col && (i != cidx || c->x < col)) {
+			if (i < term.histn) {
+				out[*nout] = term.hist[(term.histi - term.histn
+				             + 1 + i + term.histcap) % term.histcap];
+			} else {
+				l = xmalloc(maxcol * sizeof(Glyph));
+				memcpy(l, treflowline(i), ocol * sizeof(Glyph));
+				for (x = ocol; x < maxcol; x++)
+					l[x] = blank;
+				out[*nout] = (HistLine){ .line = l, .col = maxcol };
+				thistindex(&out[*nout], NULL, 0);
+			}
+			if (i == tidx)
+				*top = *nout;
+			if (i == cidx) {
+				*cy = *nout;
+				*cx = c->x;
+			}
+			(*nout)++;
+			continue;
+		}
+
+		/* gather the logical line */
+		topofs = curofs = -1;
+		for (n = 0, k = i; k <= j; k++) {
+			l = treflowline(k);
+			/* the padding a previous reflow left, see below */
+			if (k > i && n > 0 && (l[0].mode & ATTR_WIDE) &&
+			    tpad(&buf[n - 1]))
+				n--;
+			if (k == tidx)
+				topofs = n;
+			if (k == cidx)
+				curofs = n + c->x;
+			o = (k < j) ? ocol : len;
+			if (n + o > bufcap) {
+				bufcap = MAX(2 * bufcap, n + o);
+				buf = xrealloc(buf, bufcap * sizeof(Glyph));
+			}
+			for (x = 0; x < o; x++, n++) {
+				buf[n] = l[x];
+				buf[n].mode &= ~ATTR_WRAP;
+			}
+		}
+		for (k = i; k < MIN(j + 1, term.histn); k++) {
+			h = &term.hist[(term.histi - term.histn + 1 + k +
+			                term.histcap) % term.histcap];
+			free(h->line);
+			free(h->packed);
+		}
+
+		/* and break it at the new width */
+		end = MAX(n, curofs + 1);
+		for (o = 0, last = 0; !last; o += k, (*nout)++) {
+			k = MIN(col, MAX(end - o, 1));
+			/*
+			 * Wide glyphs are not split; at width 1 they lose
+			 * their dummy instead.
+			 */
+			if (k == col && o + k - 1 < n &&
+			    (buf[o + k - 1].mode & ATTR_WIDE))
+				k += (col > 1) ? -1 : 1;
+			last = o + k >= end;
+
+			if (*nout == outcap) {
+				outcap *= 2;
+				out = xrealloc(out, outcap * sizeof(*out));
+			}
+			l = xmalloc(maxcol * sizeof(Glyph));
+			for (x = 0; x < MIN(k, col) && o + x < n; x++)
+				l[x] = buf[o + x];
+			for (; x < maxcol; x++)
+				l[x] = blank;
+			if (!last) {
+				if (k < col)
+					l[col - 1] = pad;
+				l[col - 1].mode |= ATTR_WRAP;
+			}
+			out[*nout] = (HistLine){ .line = l, .col = maxcol };
+			thistindex(&out[*nout], o > 0 ? out[*nout - 1].line
+			           : NULL, col);
+
+			if (topofs >= o && (topofs < o + k || last))
+				*top = *nout;
+			if (curofs >= o && (curofs < o + k || last)) {
+				*cy = *nout;
+				*cx = MIN(curofs - o, col - 1);
+			}
+		}
+	}
+	free(buf);
+
+	return out;
+}
+
+/*
+ * Rewraps the primary screen and its history to col columns, see
+ * trewrap(). History older than the hot lines is left wrapped at the old
+ * width until something looks at it, see thistrewrap(), so that a storm
+ * of resizes only rewraps it once.
+ *
+ * The line holding the first cell of the screen stays on top unless the
+ * cursor would fall off the bottom, or the screen would not be full while
+ * there is history left to pull down; lines above it go to the history.
+ */
+void
+treflow(int col)
+{
+	Glyph blank = { .u = ' ', .col = tcolpair(defaultfg, defaultbg) };
+	Line *screen;
+	TCursor *c = IS_SET(MODE_ALTSCREEN) ? &term.saved[0] : &term.c;
+	HistLine *out, *sout, *h;
+	int ocol = term.col, maxcol = MAX(col, term.maxcol);
+	int nout, ns, top, cy, cx, k, x, wrap;
+
+	thistfreeze();
+
+	/* the stale lines have to end with a logical line */
+	if (!term.histnstale) {
+		for (k = term.histn - HIST_HOT; k > 0; k--) {
+			treflowlen(k - 1, ocol, &wrap);
+			if (!wrap)
+				break;
+		}
+		term.histnstale = MAX(k, 0);
+		term.histcol = ocol;
+	}
+
+	out = trewrap(term.histnstale, term.histn + term.row, ocol, col,
+	              &nout, &top, &cy, &cx);
+	if (nout < term.row && term.histnstale) {
+		/* too little to fill the screen, the stale lines come along */
+		sout = trewrap(0, term.histnstale, term.histcol, col, &ns,
+		               NULL, NULL, NULL);
+		sout = xrealloc(sout, (ns + nout) * sizeof(*sout));
+		memcpy(&sout[ns], out, nout * sizeof(*out));
+		free(out);
+		out = sout;
+		nout += ns;
+		top += ns;
+		cy += ns;
+		term.histnstale = 0;
 	}
+
+	if (cy - top >= term.row)
+		top = cy - term.row + 1;
+	else if (nout - top < term.row)
+		top = MAX(nout - term.row, 0);
+
+	/* everything above the screen becomes history */
+	for (k = MAX(top - (int)histsize, 0); k < top - HIST_HOT; k++)
+		thistpack(&out[k]);
+	thistsplice(out, top);
+	term.histnthaw = 0;
+	term.scr = 0;
+	/* back at the width they were wrapped at, they are fine again */
+	if (term.histcol == col)
+		term.histnstale = 0;
+
+	/* what was on the screen is all in out, it gets the new width */
+	if (IS_SET(MODE_ALTSCREEN)) {
+		screen = term.alt = tscreenalloc(&term.altbuf, term.alt, 0, 0,
+		                                 term.row, maxcol);
+	} else {
+		screen = term.line = tscreenalloc(&term.linebuf, term.line,
+		                                  0, 0, term.row, maxcol);
+	}
+	for (k = 0; k < term.row; k++) {
+		x = 0;
+		if (top + k < nout) {
+			/* history pulled down to fill the screen */
+			h = &out[top + k];
+			if (!h->line)
+				h->line = thistglyphs(h->packed);
+			x = MIN(h->col, maxcol);
+			memcpy(screen[k], h->line, x * sizeof(Glyph));
+			free(h->line);
+			free(h->packed);
+		}
+		for (; x < maxcol; x++)
+			screen[k][x] = blank;
+	}
+	for (k = top + term.row; k < nout; k++)
+		free(out[k].line);
+	free(out);
+
+	c->y = cy - top;
+	c->x = cx;
+	if (c->state & CURSOR_WRAPNEXT && cx < col - 1) {
+		c->state &= ~CURSOR_WRAPNEXT;
+		c->x++;
+	}
+	selclear();
 }
 
 void
 tscrolldown(int orig, int n, int copyhist)
 {
-	int i;
+	int i, d;
 	Line temp;
 
 	LIMIT(n, 0, term.bot-orig+1);
+	term.scrolled += n;
 
-	if (copyhist) {
-		term.histi = (term.histi - 1 + HISTSIZE) % HISTSIZE;
-		temp = term.hist[term.histi];
-		term.hist[term.histi] = term.line[term.bot];
-		term.line[term.bot] = temp;
-	}
+	if (copyhist)
+		thistpush(term.bot);
 
-	tsetdirt(orig, term.bot-n);
+	tscrollblit(orig, -n);
 	tclearregion(0, term.bot-n+1, term.col-1, term.bot);
 
-	for (i = term.bot; i >= orig+n; i--) {
-		temp = term.line[i];
-		term.line[i] = term.line[i-n];
-		term.line[i-n] = temp;
+	/* lines keep their dirtyness, only the new ones need drawing */
+	if (orig == 0 && term.bot == term.row-1) {
+		tslide(-n);
+	} else {
+		for (i = term.bot; i >= orig+n; i--) {
+			temp = term.line[i];
+			term.line[i] = term.line[i-n];
+			term.line[i-n] = temp;
+			d = term.dirty[i];
+			term.dirty[i] = term.dirty[i-n];
+			term.dirty[i-n] = d;
+		}
 	}
 
 	if (term.scr == 0)
@@ -1146,34 +2714,171 @@ tscrolldown(int orig, int n, int copyhist)
 void
 tscrollup(int orig, int n, int copyhist)
 {
-	int i;
+	int i, d;
 	Line temp;
 
 	LIMIT(n, 0, term.bot-orig+1);
+	term.scrolled += n;
 
-	if (copyhist) {
-		term.histi = (term.histi + 1) % HISTSIZE;
-		temp = term.hist[term.histi];
-		term.hist[term.histi] = term.line[orig];
-		term.line[orig] = temp;
-	}
+	if (copyhist)
+		thistpush(orig);
 
-	if (term.scr > 0 && term.scr < HISTSIZE)
-		term.scr = MIN(term.scr + n, HISTSIZE-1);
+	tscrollblit(orig, n);
+	if (term.scr > 0) {
+		term.scr = MIN(term.scr + n, term.histn);
+		/* into lines at an older width, see thistrewrap() */
+		if (term.scr > term.histn - term.histnstale) {
+			thistrewrap();
+			term.scr = MIN(term.scr, term.histn);
+			tfulldirt();
+		}
+	}
 
 	tclearregion(0, orig, term.col-1, orig+n-1);
-	tsetdirt(orig+n, term.bot);
 
-	for (i = orig; i <= term.bot-n; i++) {
-		temp = term.line[i];
-		term.line[i] = term.line[i+n];
-		term.line[i+n] = temp;
+	if (orig == 0 && term.bot == term.row-1) {
+		tslide(n);
+	} else {
+		for (i = orig; i <= term.bot-n; i++) {
+			temp = term.line[i];
+			term.line[i] = term.line[i+n];
+			term.line[i+n] = temp;
+			d = term.dirty[i];
+			term.dirty[i] = term.dirty[i+n];
+			term.dirty[i+n] = d;
+		}
 	}
 
 	if (term.scr == 0)
 		selscroll(orig, -n);
 }
 
+/*
+ * Scrolls all of the screen up by n rows, down for n < 0, by sliding
+ * term.line and term.dirty over their maps: only the rows going out at
+ * one end are put back at the other. When the window reaches an end of
+ * its map it goes back to the other one.
+ */
+void
+tslide(int n)
+{
+	int off = term.line - term.linebuf.map, i;
+
+	if ((n > 0 && off + term.row + n > 2 * term.row) ||
+	    (n < 0 && off + n < 0)) {
+		off = (n > 0) ? 0 : term.row;
+		memmove(term.linebuf.map + off, term.line,
+		        term.row * sizeof(Line));
+		term.line = term.linebuf.map + off;
+	}
+	/* both screens share dirty, it follows whichever one is shown */
+	if (term.dirty != term.dirtymap + off) {
+		memmove(term.dirtymap + off, term.dirty,
+		        term.row * sizeof(*term.dirty));
+		term.dirty = term.dirtymap + off;
+	}
+
+	for (i = 0; i < n; i++) {
+		term.line[term.row + i] = term.line[i];
+		term.dirty[term.row + i] = term.dirty[i];
+	}
+	for (i = 0; i < -n; i++) {
+		term.line[-1 - i] = term.line[term.row - 1 - i];
+		term.dirty[-1 - i] = term.dirty[term.row - 1 - i];
+	}
+	term.line += n;
+	term.dirty += n;
+}
+
+/*
+ * Gives a screen one new block of row rows of col cells, where the keep
+ * rows of line from first are copied as far as they fit. Returns the new
+ * rows of the screen.
+ */
+Line *
+tscreenalloc(ScreenBuf *b, Line *line, int first, int keep, int row, int col)
+{
+	Glyph *cells = xmalloc(row * col * sizeof(Glyph));
+	Line *map = xmalloc(2 * row * sizeof(Line));
+	int i;
+
+	for (i = 0; i < row; i++) {
+		map[i] = &cells[i * col];
+		if (i < keep) {
+			memcpy(map[i], line[first + i],
+			       MIN(b->col, col) * sizeof(Glyph));
+		}
+	}
+	free(b->cells);
+	free(b->map);
+	*b = (ScreenBuf){ .cells = cells, .map = map, .col = col };
+
+	return map;
+}
+
+/*
+ * Records that lines orig to term.bot are about to move up by n (down for
+ * n < 0), so that draw() can move what is already on the window instead
+ * of drawing them again. Scrolls which cannot be added up to the pending
+ * one, or which do not move what is shown, dirty the region instead.
+ */
+void
+tscrollblit(int orig, int n)
+{
+	if (term.scr > 0 || sel.ob.x != -1 || (term.blitn &&
+	    (term.blittop != orig || term.blitbot != term.bot))) {
+		tsetdirt(orig, term.bot);
+		return;
+	}
+
+	term.blittop = orig;
+	term.blitbot = term.bot;
+	term.blitn += n;
+	/* the old cursor is moved along with its line */
+	if (BETWEEN(term.ocy, orig, term.bot)) {
+		term.ocy -= n;
+		LIMIT(term.ocy, orig, term.bot);
+	}
+}
+
+/*
+ * Like tscrollblit(), for the whole screen moving up by n lines (down for
+ * n < 0) as the view into the history changes. Only the lines it reveals
+ * are dirtied, the others take their dirtyness along.
+ */
+void
+tscrollview(int n)
+{
+	int i;
+
+	if (abs(n) >= term.row || sel.ob.x != -1 || (term.blitn &&
+	    (term.blittop != 0 || term.blitbot != term.row-1))) {
+		tfulldirt();
+		return;
+	}
+
+	term.blittop = 0;
+	term.blitbot = term.row-1;
+	term.blitn += n;
+
+	if (n > 0) {
+		memmove(term.dirty, term.dirty + n,
+		        (term.row - n) * sizeof(*term.dirty));
+		tsetdirt(term.row - n, term.row-1);
+	} else {
+		memmove(term.dirty - n, term.dirty,
+		        (term.row + n) * sizeof(*term.dirty));
+		tsetdirt(0, -n - 1);
+	}
+
+	/* the cursor is only drawn at the bottom, its image has to go */
+	i = term.ocy - n;
+	if (term.scr == 0 && BETWEEN(i, 0, term.row-1))
+		tsetdirt(i, i);
+	term.ocy = i;
+	LIMIT(term.ocy, 0, term.row-1);
+}
+
 void
 selscroll(int orig, int n)
 {
@@ -1303,8 +3008,9 @@ tsetchar(Rune u, const Glyph *attr, int x, int y)
 void
 tclearregion(int x1, int y1, int x2, int y2)
 {
-	int x, y, temp;
-	Glyph *gp;
+	int x, y, temp, s1, s2;
+	Glyph blank = { .u = ' ', .col = term.c.attr.col };
+	Line l;
 
 	if (x1 > x2)
 		temp = x1, x1 = x2, x2 = temp;
@@ -1318,15 +3024,12 @@ tclearregion(int x1, int y1, int x2, int y2)
 
 	for (y = y1; y <= y2; y++) {
 		term.dirty[y] = 1;
-		for (x = x1; x <= x2; x++) {
-			gp = &term.line[y][x];
-			if (selected(x, y))
-				selclear();
-			gp->fg = term.c.attr.fg;
-			gp->bg = term.c.attr.bg;
-			gp->mode = 0;
-			gp->u = ' ';
-		}
+		selspan(y, &s1, &s2);
+		if (MAX(x1, s1) < MIN(x2 + 1, s2))
+			selclear();
+		/* whole glyphs at a time, the compiler makes it wide stores */
+		for (l = term.line[y], x = x1; x <= x2; x++)
+			l[x] = blank;
 	}
 }
 
@@ -1433,6 +3136,7 @@ tsetattr(const int *attr, int l)
 {
 	int i;
 	int32_t idx;
+	uint32_t fg = glyphfg(&term.c.attr), bg = glyphbg(&term.c.attr);
 
 	for (i = 0; i < l; i++) {
 		switch (attr[i]) {
@@ -1446,8 +3150,8 @@ tsetattr(const int *attr, int l)
 				ATTR_REVERSE    |
 				ATTR_INVISIBLE  |
 				ATTR_STRUCK     );
-			term.c.attr.fg = defaultfg;
-			term.c.attr.bg = defaultbg;
+			fg = defaultfg;
+			bg = defaultbg;
 			break;
 		case 1:
 			term.c.attr.mode |= ATTR_BOLD;
@@ -1498,27 +3202,27 @@ tsetattr(const int *attr, int l)
 			break;
 		case 38:
 			if ((idx = tdefcolor(attr, &i, l)) >= 0)
-				term.c.attr.fg = idx;
+				fg = idx;
 			break;
 		case 39:
-			term.c.attr.fg = defaultfg;
+			fg = defaultfg;
 			break;
 		case 48:
 			if ((idx = tdefcolor(attr, &i, l)) >= 0)
-				term.c.attr.bg = idx;
+				bg = idx;
 			break;
 		case 49:
-			term.c.attr.bg = defaultbg;
+			bg = defaultbg;
 			break;
 		default:
 			if (BETWEEN(attr[i], 30, 37)) {
-				term.c.attr.fg = attr[i] - 30;
+				fg = attr[i] - 30;
 			} else if (BETWEEN(attr[i], 40, 47)) {
-				term.c.attr.bg = attr[i] - 40;
+				bg = attr[i] - 40;
 			} else if (BETWEEN(attr[i], 90, 97)) {
-				term.c.attr.fg = attr[i] - 90 + 8;
+				fg = attr[i] - 90 + 8;
 			} else if (BETWEEN(attr[i], 100, 107)) {
-				term.c.attr.bg = attr[i] - 100 + 8;
+				bg = attr[i] - 100 + 8;
 			} else {
 				fprintf(stderr,
 					"erresc(default): gfx attr %d unknown\n",
@@ -1528,6 +3232,156 @@ tsetattr(const int *attr, int l)
 			break;
 		}
 	}
+	term.c.attr.col = tcolpair(fg, bg);
+}
+
+/*
+ * Glyph.col holds a pair of palette colours below 1 << COL_BITS right
+ * away. Pairs with a truecolour, rare in most output, are kept once in
+ * term.pair and col is their index there with COL_PAIRED set.
+ */
+uint32_t
+tcolpair(uint32_t fg, uint32_t bg)
+{
+	uint32_t mask = 2 * term.paircap - 1, h, i;
+
+	if (fg < 1 << COL_BITS && bg < 1 << COL_BITS)
+		return fg << COL_BITS | bg;
+
+	h = (fg * 0x9E3779B1u) ^ (bg * 0x85EBCA77u);
+	for (; term.paircap && (i = term.pairhash[h & mask]); h++) {
+		if (term.pair[i - 1].fg == fg && term.pair[i - 1].bg == bg)
+			return COL_PAIRED | (i - 1);
+	}
+
+	if (term.npair == COL_PAIRED)
+		return tcolpair(tcolapprox(fg), tcolapprox(bg));
+	if (term.npair == term.paircap) {
+		term.paircap = MIN(MAX(2 * term.paircap, 64), COL_PAIRED);
+		term.pair = xrealloc(term.pair,
+		                     term.paircap * sizeof(*term.pair));
+		tcolrehash();
+		return tcolpair(fg, bg);
+	}
+
+	term.pair[term.npair++] = (ColPair){ fg, bg };
+	term.pairhash[h & mask] = term.npair;
+	return COL_PAIRED | (term.npair - 1);
+}
+
+uint32_t
+glyphfg(const Glyph *g)
+{
+	if (g->col & COL_PAIRED)
+		return term.pair[g->col & ~COL_PAIRED].fg;
+	return g->col >> COL_BITS;
+}
+
+uint32_t
+glyphbg(const Glyph *g)
+{
+	if (g->col & COL_PAIRED)
+		return term.pair[g->col & ~COL_PAIRED].bg;
+	return g->col & ((1 << COL_BITS) - 1);
+}
+
+/* The nearest colour of the 6x6x6 cube, once term.pair is full. */
+uint32_t
+tcolapprox(uint32_t c)
+{
+	uint32_t r, g, b;
+
+	if (!IS_TRUECOL(c))
+		return c & ((1 << COL_BITS) - 1);
+
+	r = ((c >> 16 & 0xff) * 5 + 127) / 255;
+	g = ((c >> 8 & 0xff) * 5 + 127) / 255;
+	b = ((c & 0xff) * 5 + 127) / 255;
+	return 16 + 36 * r + 6 * g + b;
+}
+
+void
+tcolrehash(void)
+{
+	uint32_t mask = 2 * term.paircap - 1, h;
+	int i;
+
+	free(term.pairhash);
+	term.pairhash = xmalloc(2 * term.paircap * sizeof(*term.pairhash));
+	memset(term.pairhash, 0, 2 * term.paircap * sizeof(*term.pairhash));
+	for (i = 0; i < term.npair; i++) {
+		h = (term.pair[i].fg * 0x9E3779B1u) ^
+		    (term.pair[i].bg * 0x85EBCA77u);
+		while (term.pairhash[h & mask])
+			h++;
+		term.pairhash[h & mask] = i + 1;
+	}
+}
+
+/*
+ * Builds term.pair again from the glyphs still using it, as nothing tells
+ * when a pair stops being used. Only called where nobody holds on to
+ * glyphs.
+ */
+void
+tcolcompact(void)
+{
+	ColPair *old = term.pair;
+	int i;
+
+	term.pair = xmalloc(term.paircap * sizeof(*term.pair));
+	term.npair = 0;
+	memset(term.pairhash, 0, 2 * term.paircap * sizeof(*term.pairhash));
+
+	for (i = 0; i < term.row; i++) {
+		tcolrepair(term.line[i], term.maxcol, old);
+		tcolrepair(term.alt[i], term.maxcol, old);
+	}
+	for (i = 0; i < term.histcap; i++) {
+		if (term.hist[i].line)
+			tcolrepair(term.hist[i].line, term.hist[i].col, old);
+	}
+	tcolrepair(&term.c.attr, 1, old);
+	tcolrepair(&term.saved[0].attr, 1, old);
+	tcolrepair(&term.saved[1].attr, 1, old);
+
+	term.pairlive = term.npair;
+	free(old);
+}
+
+/*
+ * Makes room in term.pair for what n more bytes of output may bring, one
+ * pair a byte at most. The pairs nothing uses anymore are dropped once
+ * half the room the last tcolcompact() left is taken, so a table mostly
+ * in use is not rebuilt over and over. Only called where nobody holds on
+ * to glyphs. Returns how many of the bytes to write before calling again.
+ */
+size_t
+tcolroom(size_t n)
+{
+	size_t room;
+
+	if (term.npair + n <= COL_PAIRED)
+		return n;
+	if (2 * (term.npair - term.pairlive) >= COL_PAIRED - term.pairlive)
+		tcolcompact();
+
+	/* only a table mostly in use falls back to tcolapprox() */
+	room = COL_PAIRED - term.npair;
+	return (room >= COL_PAIRED / 16) ? MIN(n, room) : n;
+}
+
+void
+tcolrepair(Glyph *g, int n, const ColPair *old)
+{
+	const ColPair *p;
+
+	for (; n > 0; n--, g++) {
+		if (g->col & COL_PAIRED) {
+			p = &old[g->col & ~COL_PAIRED];
+			g->col = tcolpair(p->fg, p->bg);
+		}
+	}
 }
 
 void
@@ -2067,11 +3921,15 @@ strparse(void)
 void
 externalpipe(const Arg *arg)
 {
+	static char *out;
 	int to[2];
 	char buf[UTF_SIZ];
 	void (*oldsigpipe)(int);
+	const PackedLine *p;
+	HistLine *h;
 	Glyph *bp, *end;
-	int lastpos, n, newline;
+	int lastpos, n, newline, len, err = 0;
+	size_t nout = 0;
 
 	if (pipe(to) == -1)
 		return;
@@ -2092,33 +3950,94 @@ externalpipe(const Arg *arg)
 	}
 
 	close(to[0]);
+	if (!out)
+		out = xmalloc(PIPE_OUT_SIZ);
 	/* ignore sigpipe for now, in case child exists early */
 	oldsigpipe = signal(SIGPIPE, SIG_IGN);
 	newline = 0;
-	for (n = 0; n <= HISTSIZE + 2; n++) {
-		bp = TLINE_HIST(n);
-		lastpos = MIN(tlinehistlen(n) + 1, term.col) - 1;
-		if (lastpos < 0)
-			break;
-		if (lastpos == 0)
-			continue;
-		end = &bp[lastpos + 1];
-		for (; bp < end; ++bp)
-			if (xwrite(to[1], buf, utf8encode(bp->u, buf)) < 0)
-				break;
-		if ((newline = TLINE_HIST(n)[lastpos].mode & ATTR_WRAP))
+	thistrewrap();
+	for (n = 0; n < term.histn + term.row && !err; n++) {
+		p = NULL;
+		if (n < term.histn) {
+			h = &term.hist[(term.histi - term.histn + 1 + n +
+			                term.histcap) % term.histcap];
+			if (!h->line)
+				p = h->packed;
+		}
+
+		/* cold lines already are UTF-8, copy them as they are */
+		if (p && p->len <= term.col) {
+			len = (packedmode(p, term.col - 1) & ATTR_WRAP)
+			      ? term.col : p->len;
+			lastpos = MIN(len + 1, term.col) - 1;
+			if (lastpos == 0)
+				continue;
+			err = pipeput(to[1], out, &nout,
+			              (const char *)&p->run[p->nrun], p->ntext);
+			for (len = p->len; len <= lastpos && !err; len++)
+				err = pipeput(to[1], out, &nout, " ", 1);
+			newline = packedmode(p, lastpos) & ATTR_WRAP;
+		} else {
+			/* keep at most a few unpacked history lines around */
+			if (term.histnthaw > 2 * term.row)
+				thistsweep();
+			bp = TLINE_HIST(n);
+			lastpos = MIN(tlinehistlen(n) + 1, term.col) - 1;
+			if (lastpos == 0)
+				continue;
+			end = &bp[lastpos + 1];
+			for (; bp < end && !err; ++bp) {
+				err = pipeput(to[1], out, &nout, buf,
+				              utf8encode(bp->u, buf));
+			}
+			newline = bp[-1].mode & ATTR_WRAP;
+		}
+		if (newline || err)
 			continue;
-		if (xwrite(to[1], "\n", 1) < 0)
-			break;
-		newline = 0;
+		err = pipeput(to[1], out, &nout, "\n", 1);
 	}
-	if (newline)
-		(void)xwrite(to[1], "\n", 1);
+	if (newline && !err)
+		err = pipeput(to[1], out, &nout, "\n", 1);
+	if (!err)
+		xwrite(to[1], out, nout);
 	close(to[1]);
 	/* restore */
 	signal(SIGPIPE, oldsigpipe);
 }
 
+/*
+ * Appends len bytes to the output of externalpipe() in buf, holding n
+ * bytes, and writes it out once full. Returns -1 on write errors.
+ */
+int
+pipeput(int fd, char *buf, size_t *n, const char *s, size_t len)
+{
+	if (*n + len > PIPE_OUT_SIZ) {
+		if (xwrite(fd, buf, *n) < 0)
+			return -1;
+		*n = 0;
+		if (len > PIPE_OUT_SIZ)
+			return xwrite(fd, s, len) < 0 ? -1 : 0;
+	}
+	memcpy(buf + *n, s, len);
+	*n += len;
+
+	return 0;
+}
+
+/* Returns the attributes of cell x of a packed line, 0 past its width. */
+int
+packedmode(const PackedLine *p, int x)
+{
+	const AttrRun *r;
+
+	if (x >= p->col)
+		return 0;
+	for (r = p->run; x >= r->n; r++)
+		x -= r->n;
+	return r->mode;
+}
+
 void
 strdump(void)
 {
@@ -2592,7 +4511,8 @@ check_control_code:
 
 	gp = &term.line[term.c.y][term.c.x];
 	if (IS_SET(MODE_WRAP) && (term.c.state & CURSOR_WRAPNEXT)) {
-		gp->mode |= ATTR_WRAP;
+		/* on the last column, even behind a wide glyph */
+		term.line[term.c.y][term.col-1].mode |= ATTR_WRAP;
 		tnewline(1);
 		gp = &term.line[term.c.y][term.c.x];
 	}
@@ -2626,6 +4546,64 @@ check_control_code:
 	}
 }
 
+/*
+ * Fast path for runs of printable ASCII outside of any sequence: the run is
+ * stored up to the end of the cursor line in one go, touching the dirty,
+ * selection and cursor state once. Anything tputc() would treat specially
+ * (pending wrap, insert mode, the graphic charset, a cursor outside of the
+ * origin region) is left to tputc(). Returns the number of bytes consumed.
+ */
+int
+tputascii(const char *s, int len)
+{
+	int i, n, x = term.c.x, y = term.c.y, s1, s2;
+	Glyph *gp;
+
+	if (term.esc || term.c.state & CURSOR_WRAPNEXT || IS_SET(MODE_INSERT) ||
+	    term.trantbl[term.charset] == CS_GRAPHIC0 ||
+	    (term.c.state & CURSOR_ORIGIN && !BETWEEN(y, term.top, term.bot)))
+		return 0;
+
+	n = asciiprintlen(s, MIN(len, term.col - x));
+	if (n == 0)
+		return 0;
+
+	if (IS_SET(MODE_PRINT))
+		tprinter((char *)s, n);
+
+	selspan(y, &s1, &s2);
+	if (MAX(x, s1) < MIN(x + n, s2))
+		selclear();
+
+	gp = &term.line[y][x];
+	for (i = 0; i < n; i++, gp++) {
+		/* same wide character fixups as tsetchar() */
+		if (gp->mode & ATTR_WIDE) {
+			if (x+i+1 < term.col) {
+				gp[1].u = ' ';
+				gp[1].mode &= ~ATTR_WDUMMY;
+			}
+		} else if (gp->mode & ATTR_WDUMMY) {
+			gp[-1].u = ' ';
+			gp[-1].mode &= ~ATTR_WIDE;
+		}
+		*gp = term.c.attr;
+		gp->u = (uchar)s[i];
+	}
+	term.dirty[y] = 1;
+	term.lastc = (uchar)s[n-1];
+
+	if (x+n < term.col) {
+		tmoveto(x+n, y);
+	} else {
+		if (n > 1)
+			tmoveto(term.col-1, y);
+		term.c.state |= CURSOR_WRAPNEXT;
+	}
+
+	return n;
+}
+
 int
 twrite(const char *buf, int buflen, int show_ctrl)
 {
@@ -2634,6 +4612,9 @@ twrite(const char *buf, int buflen, int show_ctrl)
 	int n;
 
 	for (n = 0; n < buflen; n += charsize) {
+		if (ISPRINTASCII((uchar)buf[n]) &&
+		    (charsize = tputascii(buf + n, buflen - n)))
+			continue;
 		if (IS_SET(MODE_UTF8)) {
 			/* process a complete utf8 char */
 			charsize = utf8decode(buf + n, &u, buflen - n);
@@ -2661,10 +4642,10 @@ twrite(const char *buf, int buflen, int show_ctrl)
 void
 tresize(int col, int row)
 {
-	int i, j;
+	int i;
 	int tmp;
-	int minrow, mincol;
-	int *bp;
+	int minrow, mincol, omaxcol, reflow;
+	int *bp, *dirty;
 	TCursor c;
 
 	tmp = col;
@@ -2680,62 +4661,47 @@ tresize(int col, int row)
 		return;
 	}
 
+	/* the primary screen comes back from treflow() at full width */
+	reflow = term.col && tmp != term.col;
+	if (reflow)
+		treflow(tmp);
+	/* the rows are that wide now, thistpush() has to know */
+	omaxcol = term.maxcol;
+	term.col = tmp;
+	term.maxcol = col;
+
 	/*
 	 * slide screen to keep cursor where we expect it -
-	 * tscrollup would work here, but we can optimize to
-	 * memmove because we're freeing the earlier lines
+	 * tscrollup would work here, but the rows are copied
+	 * anyway and the earlier lines go to the history
 	 */
 	for (i = 0; i <= term.c.y - row; i++) {
-		free(term.line[i]);
-		free(term.alt[i]);
-	}
-	/* ensure that both src and dst are not NULL */
-	if (i > 0) {
-		memmove(term.line, term.line + i, row * sizeof(Line));
-		memmove(term.alt, term.alt + i, row * sizeof(Line));
-	}
-	for (i += row; i < term.row; i++) {
-		free(term.line[i]);
-		free(term.alt[i]);
+		if (!IS_SET(MODE_ALTSCREEN))
+			thistpush(i);
 	}
 
-	/* resize to new height */
-	term.line = xrealloc(term.line, row * sizeof(Line));
-	term.alt  = xrealloc(term.alt,  row * sizeof(Line));
-	term.dirty = xrealloc(term.dirty, row * sizeof(*term.dirty));
+	/* one block for each screen, the new cells are cleared below */
+	term.line = tscreenalloc(&term.linebuf, term.line, i, minrow, row, col);
+	term.alt = tscreenalloc(&term.altbuf, term.alt, i, minrow, row, col);
+
+	dirty = xmalloc(2 * row * sizeof(*dirty));
+	if (minrow > 0)
+		memcpy(dirty, term.dirty, minrow * sizeof(*dirty));
+	free(term.dirtymap);
+	term.dirty = term.dirtymap = dirty;
+	term.urls = xrealloc(term.urls, row * sizeof(*term.urls));
+	memset(term.urls, 0, row * sizeof(*term.urls));
 	term.tabs = xrealloc(term.tabs, col * sizeof(*term.tabs));
+	if (col > omaxcol) {
+		bp = term.tabs + omaxcol;
 
-	for (i = 0; i < HISTSIZE; i++) {
-		term.hist[i] = xrealloc(term.hist[i], col * sizeof(Glyph));
-		for (j = mincol; j < col; j++) {
-			term.hist[i][j] = term.c.attr;
-			term.hist[i][j].u = ' ';
-		}
-	}
-
-	/* resize each row to new width, zero-pad if needed */
-	for (i = 0; i < minrow; i++) {
-		term.line[i] = xrealloc(term.line[i], col * sizeof(Glyph));
-		term.alt[i]  = xrealloc(term.alt[i],  col * sizeof(Glyph));
-	}
-
-	/* allocate any new rows */
-	for (/* i = minrow */; i < row; i++) {
-		term.line[i] = xmalloc(col * sizeof(Glyph));
-		term.alt[i] = xmalloc(col * sizeof(Glyph));
-	}
-	if (col > term.maxcol) {
-		bp = term.tabs + term.maxcol;
-
-		memset(bp, 0, sizeof(*term.tabs) * (col - term.maxcol));
+		memset(bp, 0, sizeof(*term.tabs) * (col - omaxcol));
 		while (--bp > term.tabs && !*bp)
 			/* nothing */ ;
 		for (bp += tabspaces; bp < term.tabs + col; bp += tabspaces)
 			*bp = 1;
 	}
 	/* update terminal size */
-	term.col = tmp;
-	term.maxcol = col;
 	term.row = row;
 	/* reset scrolling region */
 	tsetscroll(0, row-1);
@@ -2744,7 +4710,8 @@ tresize(int col, int row)
 	/* Clearing both screens (it makes dirty all lines) */
 	c = term.c;
 	for (i = 0; i < 2; i++) {
-		if (mincol < col && 0 < minrow) {
+		if (mincol < col && 0 < minrow &&
+		    (!reflow || IS_SET(MODE_ALTSCREEN))) {
 			tclearregion(mincol, 0, col - 1, minrow - 1);
 		}
 		if (0 < col && minrow < row) {
@@ -2773,7 +4740,151 @@ drawregion(int x1, int y1, int x2, int y2)
 
 		term.dirty[y] = 0;
 		xdrawline(TLINE(y), x1, y, x2);
+		turlscan(y);
+		/* a prefix at the end of the row above may go on here */
+		if (y > 0 && (TLINE(y - 1)[term.col - 1].mode & ATTR_WRAP))
+			turlscan(y - 1);
+	}
+}
+
+int
+isurlchar(Rune u)
+{
+	return u && u < 0x80 && (isalnum(u) || strchr(":;./+@$&%?#=_~-", u));
+}
+
+/*
+ * Finds the URLs in row y of the window after it was drawn: text from
+ * one of urlprefixes on, minus a trailing punctuation mark. A prefix
+ * ending the row counts if the row wraps onto a URL character. Rows only
+ * change when they are drawn again or moved by turlscroll(), so the
+ * spans stay valid until then; output not drawn yet needs turlrescan().
+ */
+void
+turlscan(int y)
+{
+	static const char *urlprefixes[] = {
+		"http://", "https://", "gopher://", "gemini://", "ftp://",
+		"ftps://", "git://", "www.", "magnet:?xt=urn:btih:",
+	};
+	UrlRow *r = &term.urls[y];
+	Line l = TLINE(y);
+	const char *p;
+	int x, e, i;
+
+	r->n = 0;
+	for (x = 0; x < term.col && r->n < URL_PER_LINE; x++) {
+		/* the first letters of urlprefixes */
+		if (!l[x].u || l[x].u >= 0x80 || !strchr("fghmw", l[x].u))
+			continue;
+		for (i = 0; i < LEN(urlprefixes); i++) {
+			for (p = urlprefixes[i], e = x; *p && e < term.col &&
+			     l[e].u == *p; p++, e++)
+				;
+			if (!*p)
+				break;
+		}
+		if (i == LEN(urlprefixes))
+			continue;
+		if (e == term.col) {
+			if (!(l[e - 1].mode & ATTR_WRAP) || y + 1 == term.row ||
+			    !isurlchar(TLINE(y + 1)[0].u))
+				continue;
+		} else if (!isurlchar(l[e].u)) {
+			continue;
+		}
+
+		while (e < term.col && isurlchar(l[e].u))
+			e++;
+		if (strchr(".,;!?", l[e - 1].u) &&
+		    !(e == term.col && (l[e - 1].mode & ATTR_WRAP)))
+			e--;
+		r->span[r->n][0] = x;
+		r->span[r->n][1] = e - 1;
+		r->n++;
+		x = e - 1;
+	}
+}
+
+/* Moves the URLs found along with the rows xscroll() moves. */
+void
+turlscroll(int top, int bot, int n)
+{
+	if (abs(n) > bot - top)
+		return;
+	if (n > 0) {
+		memmove(&term.urls[top], &term.urls[top + n],
+		        (bot - top + 1 - n) * sizeof(*term.urls));
+	} else {
+		memmove(&term.urls[top - n], &term.urls[top],
+		        (bot - top + 1 + n) * sizeof(*term.urls));
+	}
+}
+
+/* Finds the URLs on the whole window as it is now, drawn or not. */
+void
+turlrescan(void)
+{
+	int y;
+
+	for (y = 0; y < term.row; y++)
+		turlscan(y);
+}
+
+/*
+ * Stores up to max URLs on the window in hints, the cell each starts at,
+ * the bottom one first. Returns how many.
+ */
+int
+turlhints(int (*hints)[2], int max)
+{
+	int y, i, n = 0;
+
+	for (y = term.row - 1; y >= 0; y--) {
+		for (i = term.urls[y].n - 1; i >= 0 && n < max; i--, n++) {
+			hints[n][0] = term.urls[y].span[i][0];
+			hints[n][1] = y;
+		}
+	}
+
+	return n;
+}
+
+/*
+ * Returns the URL starting at cell x of row y of the window, continued on
+ * the rows it wraps to, as a new string. Returns NULL if the row as it is
+ * now has no URL starting there, as after output moved it.
+ */
+char *
+turlget(int x, int y)
+{
+	char *s, *t;
+	Line l = TLINE(y);
+	int i;
+
+	turlscan(y);
+	for (i = 0; i < term.urls[y].n && term.urls[y].span[i][0] != x; i++)
+		;
+	if (i == term.urls[y].n)
+		return NULL;
+
+	s = t = xmalloc(term.col * (term.row - y) + 8);
+	if (l[x].u == 'w')
+		t += sprintf(s, "http://");
+	for (;;) {
+		for (; x < term.col && isurlchar(l[x].u); x++)
+			*t++ = l[x].u;
+		if (x < term.col || !(l[x - 1].mode & ATTR_WRAP) ||
+		    ++y == term.row)
+			break;
+		l = TLINE(y);
+		x = 0;
 	}
+	if (t > s && strchr(".,;!?", t[-1]))
+		t--;
+	*t = '\0';
+
+	return s;
 }
 
 void
@@ -2781,9 +4892,19 @@ draw(void)
 {
 	int cx = term.c.x, ocx = term.ocx, ocy = term.ocy;
 
+	term.scrolled = 0;
+	/* truecolour pairs nothing uses anymore pile up in term.pair */
+	if (term.npair >= COL_PAIRED / 2 && term.npair >= 2 * term.pairlive)
+		tcolcompact();
 	if (!xstartdraw())
 		return;
 
+	if (term.blitn) {
+		xscroll(term.blittop, term.blitbot, term.blitn);
+		turlscroll(term.blittop, term.blitbot, term.blitn);
+		term.blitn = 0;
+	}
+
 	/* adjust cursor position */
 	LIMIT(term.ocx, 0, term.col-1);
 	LIMIT(term.ocy, 0, term.row-1);
@@ -12,8 +12,7 @@
 #define DEFAULT(a, b)		(a) = (a) ? (a) : (b)
 #define LIMIT(x, a, b)		(x) = (x) < (a) ? (a) : (x) > (b) ? (b) : (x)
 #define ATTRCMP(a, b)		(((a).mode & (~ATTR_WRAP) & (~ATTR_LIGA)) != ((b).mode & (~ATTR_WRAP) & (~ATTR_LIGA)) || \
-				(a).fg != (b).fg || \
-				(a).bg != (b).bg)
+				(a).col != (b).col)
 #define TIMEDIFF(t1, t2)	((t1.tv_sec-t2.tv_sec)*1000 + \
 				(t1.tv_nsec-t2.tv_nsec)/1E6)
 #define MODBIT(x, set, bit)	((set) ? ((x) |= (bit)) : ((x) &= ~(bit)))
@@ -64,10 +63,9 @@ typedef uint_least32_t Rune;
 
 #define Glyph Glyph_
 typedef struct {
-	Rune u;           /* character code */
-	ushort mode;      /* attribute flags */
-	uint32_t fg;      /* foreground  */
-	uint32_t bg;      /* background  */
+	Rune u;             /* character code */
+	uint32_t mode : 13; /* attribute flags, room for all of ATTR_* */
+	uint32_t col : 19;  /* foreground and background, see tcolpair() */
 } Glyph;
 
 typedef Glyph *Line;
@@ -95,6 +93,8 @@ void sendbreak(const Arg *);
 void toggleprinter(const Arg *);
 
 int tattrset(int);
+int tscrolled(void);
+int tsearch(const char *, int);
 void tnew(int, int);
 void tresize(int, int);
 void tsetdirtattr(int);
@@ -103,6 +103,16 @@ int ttynew(const char *, char *, const char *, char **);
 size_t ttyread(void);
 void ttyresize(int, int);
 void ttywrite(const char *, size_t, int);
+int ttywritefd(void);
+void ttyflush(void);
+
+enum trace_mode {
+	TRACE_RECORD = 1,
+	TRACE_REPLAY,     /* at the recorded pace */
+	TRACE_REPLAYFAST, /* as fast as the terminal parses */
+};
+
+void traceopen(const char *, int);
 
 void resettitle(void);
 
@@ -111,8 +121,17 @@ void selinit(void);
 void selstart(int, int, int);
 void selextend(int, int, int, int);
 int selected(int, int);
+void selspan(int, int *, int *);
 char *getsel(void);
 
+uint32_t tcolpair(uint32_t, uint32_t);
+uint32_t glyphfg(const Glyph *);
+uint32_t glyphbg(const Glyph *);
+
+void turlrescan(void);
+int turlhints(int (*)[2], int);
+char *turlget(int, int);
+
 size_t utf8encode(Rune, char *);
 
 void *xmalloc(size_t);
@@ -137,6 +156,7 @@ extern int allowaltscreen;
 extern int allowwindowops;
 extern char *termname;
 extern unsigned int tabspaces;
+extern unsigned int histsize;
 extern unsigned int defaultfg;
 extern unsigned int defaultbg;
 extern float alpha;
@@ -5,11 +5,13 @@
 #include <locale.h>
 #include <signal.h>
 #include <sys/select.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 #include <libgen.h>
 #include <X11/Xatom.h>
 #include <X11/Xlib.h>
+#include <X11/Xproto.h>
 #include <X11/cursorfont.h>
 #include <X11/keysym.h>
 #include <X11/Xft/Xft.h>
@@ -75,6 +77,9 @@ static void zoom(const Arg *);
 static void zoomabs(const Arg *);
 static void zoomreset(const Arg *);
 static void ttysend(const Arg *);
+static void togglestats(const Arg *);
+static void searchstart(const Arg *);
+static void urlhints(const Arg *);
 
 /* config.h for applying patches and the configuration. */
 #include "config.h"
@@ -108,6 +113,8 @@ typedef struct {
 	Colormap cmap;
 	Window win;
 	Drawable buf;
+	XRectangle damage[16]; /* bands of buf changed since the last copy */
+	int ndamage; /* -1 when all of buf is to be copied */
 	GlyphFontSpec *specbuf; /* font spec buffer used for rendering */
 	Atom xembed, wmdeletewin, netwmname, netwmiconname, netwmpid;
 	struct {
@@ -117,6 +124,7 @@ typedef struct {
 		XVaNestedList spotlist;
 	} ime;
 	Draw draw;
+	Draw overlay; /* on the window itself, over what is copied from buf */
 	Visual *vis;
 	XSetWindowAttributes attrs;
 	int scr;
@@ -126,11 +134,24 @@ typedef struct {
 	int gm; /* geometry mask */
 } XWindow;
 
+/* a selection too large for one request, sent with INCR in pieces */
+typedef struct {
+	Window requestor;
+	Atom property, target;
+	char *text; /* kept from selfree() until the transfer ends */
+	size_t off, len;
+} Incr;
+
 typedef struct {
 	Atom xtarget;
-	char *primary, *clipboard;
+	char *primary, *clipboard; /* can be the same string */
 	struct timespec tclick1;
 	struct timespec tclick2;
+	Incr *incr; /* transfers to other clients in progress */
+	int nincr;
+	size_t incrsiz; /* largest piece of a selection sent at once */
+	int incrpaste; /* an INCR paste is being received */
+	Window incrowner; /* from this window */
 } XSelection;
 
 /* Font structure */
@@ -162,6 +183,10 @@ static int xmakeglyphfontspecs(XftGlyphFontSpec *, const Glyph *, int, int, int)
 static void xdrawglyphfontspecs(const XftGlyphFontSpec *, Glyph, int, int, int);
 static void xdrawglyph(Glyph, int, int);
 static void xclear(int, int, int, int);
+static void xqueuefill(const XftColor *, int, int, int, int);
+static void xqueueclear(int, int, int, int);
+static void xflushruns(void);
+static void xdamage(int, int);
 static int xgeommasktogravity(int);
 static int ximopen(Display *);
 static void ximinstantiate(Display *, XPointer, XPointer);
@@ -178,8 +203,19 @@ static void xloadsparefonts(void);
 static void xloadfonts(const char *, double);
 static void xunloadfont(Font *);
 static void xunloadfonts(void);
+static void statsreset(const struct timespec *);
+static void statsinput(size_t, const struct timespec *);
+static void statskey(void);
+static void statsframe(void);
+static void statsdraw(void);
+static void searchkey(KeySym, uint, const char *, int);
+static void searchdraw(void);
+static void urlhintkey(KeySym, const char *, int);
+static void urlhintdraw(void);
+static void urlopen(char *);
 static void xsetenv(void);
 static void xseturgency(int);
+static int xerror(Display *, XErrorEvent *);
 static int evcol(XEvent *);
 static int evrow(XEvent *);
 static float clamp(float, float, float);
@@ -196,10 +232,17 @@ static int mouseaction(XEvent *, uint);
 static void brelease(XEvent *);
 static void bpress(XEvent *);
 static void bmotion(XEvent *);
+static void destroynotify(XEvent *);
 static void propnotify(XEvent *);
 static void selnotify(XEvent *);
 static void selclear_(XEvent *);
 static void selrequest(XEvent *);
+static void selincrstart(XSelectionRequestEvent *, char *, size_t);
+static void selincr(int);
+static void selincrdrop(int);
+static void selpasteend(void);
+static void selwatch(Window);
+static void selfree(char *);
 static void setsel(char *, Time);
 static void mousesel(XEvent *, int);
 static void mousereport(XEvent *);
@@ -233,14 +276,48 @@ static void (*handler[LASTEvent])(XEvent *) = {
  */
 	[PropertyNotify] = propnotify,
 	[SelectionRequest] = selrequest,
+	[DestroyNotify] = destroynotify,
 };
 
 /* Globals */
 static DC dc;
 static XWindow xw;
 static XSelection xsel;
+static int (*xerrorxlib)(Display *, XErrorEvent *);
 static TermWindow win;
 
+/*
+ * Drawing batched by xdrawglyphfontspecs() until xflushruns(): the
+ * background fills, and a run of glyphs per attribute segment.
+ */
+typedef struct {
+	XftColor color;
+	XRectangle r;
+} Fill;
+
+typedef struct {
+	XftColor fg, bg;
+	int y;        /* line */
+	int winx, width;
+	int spec, len; /* glyphs in batch.specs */
+	ushort mode;
+	int done;     /* drawn with an earlier run of its colour */
+} Run;
+
+typedef struct {
+	Fill *fills;
+	XRectangle *rects; /* scratch for the fills of one colour */
+	int nfills, fillscap;
+	Run *runs;
+	XRectangle *clips; /* scratch for the runs of one colour */
+	int nruns, runscap;
+	XftGlyphFontSpec *specs;
+	XftGlyphFontSpec *scratch; /* the glyphs of one colour */
+	int nspecs, specscap;
+} Batch;
+
+static Batch batch;
+
 /* Font Ring Cache */
 enum {
 	FRC_NORMAL,
@@ -259,6 +336,26 @@ typedef struct {
 static Fontcache *frc = NULL;
 static int frclen = 0;
 static int frccap = 0;
+
+/*
+ * Glyph lookup cache in front of the font ring cache: maps a rune and its
+ * FRC_* style to the font and glyph index found for it last time, so the
+ * linear walk over frc only happens on a miss.  Direct mapped, an entry is
+ * valid only if it carries the current generation; bumping the generation
+ * drops the whole cache when the fonts are unloaded.
+ */
+typedef struct {
+	Rune rune;
+	int flags;
+	int font; /* index into frc, -1 for the style's own font */
+	FT_UInt glyph;
+	unsigned int gen;
+} Glyphcache;
+
+#define GLYPHCACHESIZ 4096 /* must be a power of two */
+
+static Glyphcache gcache[GLYPHCACHESIZ];
+static unsigned int gcachegen = 1;
 static char *usedfont = NULL;
 static double usedfontsize = 0;
 static double defaultfontsize = 0;
@@ -272,6 +369,47 @@ static char *opt_io    = NULL;
 static char *opt_line  = NULL;
 static char *opt_name  = NULL;
 static char *opt_title = NULL;
+static char *opt_trace = NULL;
+static int opt_tracemode = 0;
+
+/*
+ * Frame statistics, summed up every second: shown over the window while
+ * togglestats() has them on, appended to the file named by $ST_STATS.
+ */
+typedef struct {
+	int show;
+	FILE *fp;
+	struct timespec since; /* start of the current second */
+	struct timespec start; /* of the frame being drawn */
+	struct timespec input; /* first pty input not drawn yet */
+	struct timespec key;   /* first keypress not echoed yet */
+	int inputpending, keypending, keyechoed;
+	int frames, lines, nin, nkey;
+	size_t bytes;
+	double drawms, inms, keyms;
+	char text[128];        /* the last summary */
+	int x;                 /* where statsdraw() put its left edge */
+} Stats;
+
+static Stats stats;
+
+/* Scrollback search, the prompt is shown over the last line */
+typedef struct {
+	char q[256];           /* the query, UTF-8 */
+	int len;
+	int found;             /* the query has a match */
+} Search;
+
+static Search search;
+
+/* URL hints: a letter shown over each URL on the window picks it */
+typedef struct {
+	int copy;              /* to the clipboard instead of opening it */
+	int cell[26][2];       /* where the URLs start */
+	int n;
+} UrlHint;
+
+static UrlHint urlhint;
 
 static int focused = 0;
 
@@ -282,12 +420,12 @@ void
 clipcopy(const Arg *dummy)
 {
 	Atom clipboard;
+	char *old = xsel.clipboard;
 
-	free(xsel.clipboard);
-	xsel.clipboard = NULL;
+	xsel.clipboard = xsel.primary;
+	selfree(old);
 
 	if (xsel.primary != NULL) {
-		xsel.clipboard = xstrdup(xsel.primary);
 		clipboard = XInternAtom(xw.dpy, "CLIPBOARD", 0);
 		XSetSelectionOwner(xw.dpy, clipboard, xw.win, CurrentTime);
 	}
@@ -316,6 +454,45 @@ numlock(const Arg *dummy)
 	win.mode ^= MODE_NUMLOCK;
 }
 
+void
+togglestats(const Arg *dummy)
+{
+	struct timespec now;
+
+	stats.show = !stats.show;
+	if (stats.show && !stats.fp) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		statsreset(&now);
+		strcpy(stats.text, "...");
+	}
+	redraw();
+}
+
+void
+searchstart(const Arg *dummy)
+{
+	win.mode |= MODE_SEARCH;
+	search.len = 0;
+	search.q[0] = '\0';
+	search.found = 1;
+	/* start from the bottom of the view, not from some selection */
+	selclear();
+	redraw();
+}
+
+void
+urlhints(const Arg *arg)
+{
+	urlhint.copy = arg->i;
+	/* output since the last draw is not scanned yet */
+	turlrescan();
+	urlhint.n = turlhints(urlhint.cell, LEN(urlhint.cell));
+	if (urlhint.n == 0)
+		return;
+	win.mode |= MODE_URLHINT;
+	redraw();
+}
+
 void
 changealpha(const Arg *arg)
 {
@@ -540,14 +717,41 @@ bpress(XEvent *e)
 	}
 }
 
+void
+destroynotify(XEvent *e)
+{
+	int i;
+
+	/* a requestor went away in the middle of a transfer */
+	for (i = xsel.nincr - 1; i >= 0; i--) {
+		if (xsel.incr[i].requestor == e->xdestroywindow.window)
+			selincrdrop(i);
+	}
+	/* or the owner of what we are pasting, the rest is not coming */
+	if (xsel.incrpaste && xsel.incrowner == e->xdestroywindow.window) {
+		xsel.incrowner = None;
+		selpasteend();
+	}
+}
+
 void
 propnotify(XEvent *e)
 {
 	XPropertyEvent *xpev;
 	Atom clipboard = XInternAtom(xw.dpy, "CLIPBOARD", 0);
+	int i;
 
 	xpev = &e->xproperty;
-	if (xpev->state == PropertyNewValue &&
+	if (xpev->state == PropertyDelete) {
+		/* the requestor took a piece of what we are sending */
+		for (i = 0; i < xsel.nincr; i++) {
+			if (xsel.incr[i].requestor == xpev->window &&
+			    xsel.incr[i].property == xpev->atom) {
+				selincr(i);
+				break;
+			}
+		}
+	} else if (xpev->window == xw.win &&
 			(xpev->atom == XA_PRIMARY ||
 			 xpev->atom == clipboard)) {
 		selnotify(e);
@@ -565,23 +769,32 @@ selnotify(XEvent *e)
 	incratom = XInternAtom(xw.dpy, "INCR", 0);
 
 	ofs = 0;
-	if (e->type == SelectionNotify)
+	if (e->type == SelectionNotify) {
 		property = e->xselection.property;
-	else if (e->type == PropertyNotify)
+		/* a new paste, whatever happened to the last one */
+		selpasteend();
+	} else if (e->type == PropertyNotify) {
 		property = e->xproperty.atom;
+	}
 
 	if (property == None)
 		return;
 
 	do {
 		if (XGetWindowProperty(xw.dpy, xw.win, property, ofs,
-					BUFSIZ/4, False, AnyPropertyType,
+					xsel.incrsiz/4, False, AnyPropertyType,
 					&type, &format, &nitems, &rem,
 					&data)) {
 			fprintf(stderr, "Clipboard allocation failed\n");
 			return;
 		}
 
+		/* already taken, when we answer our own request with INCR */
+		if (type == None) {
+			XFree(data);
+			break;
+		}
+
 		if (e->type == PropertyNotify && nitems == 0 && rem == 0) {
 			/*
 			 * If there is some PropertyNotify with no data, then
@@ -589,25 +802,41 @@ selnotify(XEvent *e)
 			 * data has been transferred. We won't need to receive
 			 * PropertyNotify events anymore.
 			 */
-			MODBIT(xw.attrs.event_mask, 0, PropertyChangeMask);
-			XChangeWindowAttributes(xw.dpy, xw.win, CWEventMask,
-					&xw.attrs);
+			selpasteend();
+			XFree(data);
+			break;
 		}
 
 		if (type == incratom) {
+			/*
+			 * The pieces go to the tty as they come, bracketed
+			 * once around all of them.
+			 */
+			if (IS_SET(MODE_BRCKTPASTE))
+				ttywrite("\033[200~", 6, 0);
+			xsel.incrpaste = 1;
+
 			/*
 			 * Activate the PropertyNotify events so we receive
 			 * when the selection owner does send us the next
-			 * chunk of data.
+			 * chunk of data, and watch the owner for going away
+			 * before the last one.
 			 */
-			MODBIT(xw.attrs.event_mask, 1, PropertyChangeMask);
-			XChangeWindowAttributes(xw.dpy, xw.win, CWEventMask,
-					&xw.attrs);
+			xsel.incrowner = XGetSelectionOwner(xw.dpy,
+					e->xselection.selection);
+			selwatch(xw.win);
+			selwatch(xsel.incrowner);
+			if (xsel.incrowner == None) {
+				selpasteend();
+				XFree(data);
+				break;
+			}
 
 			/*
 			 * Deleting the property is the transfer start signal.
 			 */
 			XDeleteProperty(xw.dpy, xw.win, (int)property);
+			XFree(data);
 			continue;
 		}
 
@@ -624,10 +853,10 @@ selnotify(XEvent *e)
 			*repl++ = '\r';
 		}
 
-		if (IS_SET(MODE_BRCKTPASTE) && ofs == 0)
+		if (IS_SET(MODE_BRCKTPASTE) && !xsel.incrpaste && ofs == 0)
 			ttywrite("\033[200~", 6, 0);
 		ttywrite((char *)data, nitems * format / 8, 1);
-		if (IS_SET(MODE_BRCKTPASTE) && rem == 0)
+		if (IS_SET(MODE_BRCKTPASTE) && !xsel.incrpaste && rem == 0)
 			ttywrite("\033[201~", 6, 0);
 		XFree(data);
 		/* number of 32-bit chunks returned */
@@ -660,6 +889,7 @@ selrequest(XEvent *e)
 	XSelectionEvent xev;
 	Atom xa_targets, string, clipboard;
 	char *seltext;
+	size_t len;
 
 	xsre = (XSelectionRequestEvent *) e;
 	xev.type = SelectionNotify;
@@ -698,10 +928,15 @@ selrequest(XEvent *e)
 			return;
 		}
 		if (seltext != NULL) {
-			XChangeProperty(xsre->display, xsre->requestor,
-					xsre->property, xsre->target,
-					8, PropModeReplace,
-					(uchar *)seltext, strlen(seltext));
+			len = strlen(seltext);
+			if (len > xsel.incrsiz) {
+				selincrstart(xsre, seltext, len);
+			} else {
+				XChangeProperty(xsre->display, xsre->requestor,
+						xsre->property, xsre->target,
+						8, PropModeReplace,
+						(uchar *)seltext, len);
+			}
 			xev.property = xsre->property;
 		}
 	}
@@ -711,14 +946,136 @@ selrequest(XEvent *e)
 		fprintf(stderr, "Error sending SelectionNotify event\n");
 }
 
+/*
+ * Answers a request for more text than fits in one request with INCR:
+ * each time the requestor deletes the property to take a piece of it,
+ * propnotify() puts the next one there.
+ */
+void
+selincrstart(XSelectionRequestEvent *xsre, char *text, size_t len)
+{
+	Atom incratom = XInternAtom(xw.dpy, "INCR", 0);
+	long size = len;
+	int i;
+
+	/* a new request on the same property restarts the transfer */
+	for (i = 0; i < xsel.nincr; i++) {
+		if (xsel.incr[i].requestor == xsre->requestor &&
+		    xsel.incr[i].property == xsre->property) {
+			selincrdrop(i);
+			break;
+		}
+	}
+	xsel.incr = xrealloc(xsel.incr, (xsel.nincr + 1) * sizeof(Incr));
+	xsel.incr[xsel.nincr++] = (Incr){ xsre->requestor, xsre->property,
+	                                  xsre->target, text, 0, len };
+
+	selwatch(xsre->requestor);
+	XChangeProperty(xw.dpy, xsre->requestor, xsre->property, incratom,
+			32, PropModeReplace, (uchar *)&size, 1);
+}
+
+/*
+ * Puts the next piece of transfer i in the property. The empty piece
+ * after the last one ends it.
+ */
+void
+selincr(int i)
+{
+	Incr *t = &xsel.incr[i];
+	Window requestor = t->requestor;
+	size_t n = MIN(t->len - t->off, xsel.incrsiz);
+
+	XChangeProperty(xw.dpy, t->requestor, t->property, t->target, 8,
+			PropModeReplace, (uchar *)t->text + t->off, n);
+	t->off += n;
+	if (n > 0)
+		return;
+
+	selincrdrop(i);
+	selwatch(requestor);
+}
+
+void
+selincrdrop(int i)
+{
+	char *text = xsel.incr[i].text;
+
+	xsel.incr[i] = xsel.incr[--xsel.nincr];
+	selfree(text);
+}
+
+/* Ends the INCR paste being received, closing its bracket. */
+void
+selpasteend(void)
+{
+	Window owner = xsel.incrowner;
+
+	if (!xsel.incrpaste)
+		return;
+	if (IS_SET(MODE_BRCKTPASTE))
+		ttywrite("\033[201~", 6, 0);
+	xsel.incrpaste = 0;
+	xsel.incrowner = None;
+	selwatch(xw.win);
+	selwatch(owner);
+}
+
+/*
+ * Selects the events of window w that the INCR transfers to it and the
+ * paste from it still need. Our own window shares PropertyChangeMask
+ * between both, when pasting from ourselves.
+ */
+void
+selwatch(Window w)
+{
+	long mask = NoEventMask;
+	int i;
+
+	if (w == None)
+		return;
+	for (i = 0; i < xsel.nincr; i++) {
+		if (xsel.incr[i].requestor == w)
+			mask = PropertyChangeMask | StructureNotifyMask;
+	}
+
+	if (w == xw.win) {
+		MODBIT(xw.attrs.event_mask, mask || xsel.incrpaste,
+		       PropertyChangeMask);
+		XChangeWindowAttributes(xw.dpy, xw.win, CWEventMask,
+				&xw.attrs);
+		return;
+	}
+	if (w == xsel.incrowner)
+		mask |= StructureNotifyMask;
+	XSelectInput(xw.dpy, w, mask);
+}
+
+/* Frees a selection string nothing refers to anymore. */
+void
+selfree(char *s)
+{
+	int i;
+
+	if (s == xsel.primary || s == xsel.clipboard)
+		return;
+	for (i = 0; i < xsel.nincr; i++) {
+		if (xsel.incr[i].text == s)
+			return;
+	}
+	free(s);
+}
+
 void
 setsel(char *str, Time t)
 {
+	char *old = xsel.primary;
+
 	if (!str)
 		return;
 
-	free(xsel.primary);
 	xsel.primary = str;
+	selfree(old);
 
 	XSetSelectionOwner(xw.dpy, XA_PRIMARY, xw.win, t);
 	if (XGetSelectionOwner(xw.dpy, XA_PRIMARY) != xw.win)
@@ -731,6 +1088,16 @@ xsetsel(char *str)
 	setsel(str, CurrentTime);
 }
 
+void
+xsetsize(int col, int row)
+{
+	int w = 2 * borderpx + col * win.cw, h = 2 * borderpx + row * win.ch;
+
+	/* the terminal follows right away, the window once the wm agrees */
+	cresize(w, h);
+	XResizeWindow(xw.dpy, xw.win, w, h);
+}
+
 void
 brelease(XEvent *e)
 {
@@ -792,6 +1159,7 @@ xresize(int col, int row)
 			xw.depth);
 	XftDrawChange(xw.draw, xw.buf);
 	xclear(0, 0, win.w, win.h);
+	xw.ndamage = -1;
 
 	/* resize to new width */
 	xw.specbuf = xrealloc(xw.specbuf, col * sizeof(GlyphFontSpec));
@@ -1209,6 +1577,9 @@ xunloadfonts(void)
 	/* Clear Harfbuzz font cache. */
 	hbunloadfonts();
 
+	/* The cached lookups point into the fonts freed below. */
+	gcachegen++;
+
 	/* Free the loaded fonts in the font cache.  */
 	while (frclen > 0)
 		XftFontClose(xw.dpy, frc[--frclen].font);
@@ -1345,6 +1716,7 @@ xinit(int cols, int rows)
 
 	/* Xft rendering context */
 	xw.draw = XftDrawCreate(xw.dpy, xw.buf, xw.vis, xw.cmap);
+	xw.overlay = XftDrawCreate(xw.dpy, xw.win, xw.vis, xw.cmap);
 
 	/* input methods */
 	if (!ximopen(xw.dpy)) {
@@ -1390,6 +1762,8 @@ xinit(int cols, int rows)
 	clock_gettime(CLOCK_MONOTONIC, &xsel.tclick2);
 	xsel.primary = NULL;
 	xsel.clipboard = NULL;
+	/* half of the largest request, which is counted in 4-byte units */
+	xsel.incrsiz = MIN(XMaxRequestSize(xw.dpy) * 2, 64 * 1024);
 	xsel.xtarget = XInternAtom(xw.dpy, "UTF8_STRING", 0);
 	if (xsel.xtarget == None)
 		xsel.xtarget = XA_STRING;
@@ -1411,6 +1785,7 @@ xmakeglyphfontspecs(XftGlyphFontSpec *specs, const Glyph *glyphs, int len, int x
 	FcPattern *fcpattern, *fontpattern;
 	FcFontSet *fcsets[] = { NULL };
 	FcCharSet *fccharset;
+	Glyphcache *gc;
 	int i, f, numspecs = 0;
 
 	for (i = 0, xp = winx, yp = winy + font->ascent; i < len; ++i) {
@@ -1444,11 +1819,33 @@ xmakeglyphfontspecs(XftGlyphFontSpec *specs, const Glyph *glyphs, int len, int x
 		if (mode & ATTR_BOXDRAW) {
 			/* minor shoehorning: boxdraw uses only this ushort */
 			glyphidx = boxdrawindex(&glyphs[i]);
+			gc = NULL;
 		} else {
+			gc = &gcache[((rune << 2 | frcflags) * 2654435761u >> 20)
+			             & (GLYPHCACHESIZ - 1)];
+			if (gc->gen == gcachegen && gc->rune == rune
+					&& gc->flags == frcflags) {
+				specs[numspecs].font = (gc->font < 0)
+					? font->match : frc[gc->font].font;
+				specs[numspecs].glyph = gc->glyph;
+				specs[numspecs].x = (short)xp;
+				specs[numspecs].y = (short)yp;
+				xp += runewidth;
+				numspecs++;
+				continue;
+			}
+			gc->gen = gcachegen;
+			gc->rune = rune;
+			gc->flags = frcflags;
+
 			/* Lookup character index with default font. */
 			glyphidx = XftCharIndex(xw.dpy, font->match, rune);
 		}
 		if (glyphidx) {
+			if (gc) {
+				gc->font = -1;
+				gc->glyph = glyphidx;
+			}
 			specs[numspecs].font = font->match;
 			specs[numspecs].glyph = glyphidx;
 			specs[numspecs].x = (short)xp;
@@ -1523,6 +1920,11 @@ xmakeglyphfontspecs(XftGlyphFontSpec *specs, const Glyph *glyphs, int len, int x
 			FcCharSetDestroy(fccharset);
 		}
 
+		if (gc) {
+			gc->font = f;
+			gc->glyph = glyphidx;
+		}
+
 		specs[numspecs].font = frc[f].font;
 		specs[numspecs].glyph = glyphidx;
 		specs[numspecs].x = (short)xp;
@@ -1545,42 +1947,45 @@ xdrawglyphfontspecs(const XftGlyphFontSpec *specs, Glyph base, int len, int x, i
 	    width = charlen * win.cw;
 	Color *fg, *bg, *temp, revfg, revbg, truefg, truebg;
 	XRenderColor colfg, colbg;
-	XRectangle r;
+	uint32_t basefg = glyphfg(&base), basebg = glyphbg(&base);
+	Run *run;
+
+	xdamage(y, y);
 
 	/* Fallback on color display for attributes not supported by the font */
 	if (base.mode & ATTR_ITALIC && base.mode & ATTR_BOLD) {
 		if (dc.ibfont.badslant || dc.ibfont.badweight)
-			base.fg = defaultattr;
+			basefg = defaultattr;
 	} else if ((base.mode & ATTR_ITALIC && dc.ifont.badslant) ||
 	    (base.mode & ATTR_BOLD && dc.bfont.badweight)) {
-		base.fg = defaultattr;
+		basefg = defaultattr;
 	}
 
-	if (IS_TRUECOL(base.fg)) {
+	if (IS_TRUECOL(basefg)) {
 		colfg.alpha = 0xffff;
-		colfg.red = TRUERED(base.fg);
-		colfg.green = TRUEGREEN(base.fg);
-		colfg.blue = TRUEBLUE(base.fg);
+		colfg.red = TRUERED(basefg);
+		colfg.green = TRUEGREEN(basefg);
+		colfg.blue = TRUEBLUE(basefg);
 		XftColorAllocValue(xw.dpy, xw.vis, xw.cmap, &colfg, &truefg);
 		fg = &truefg;
 	} else {
-		fg = &dc.col[base.fg];
+		fg = &dc.col[basefg];
 	}
 
-	if (IS_TRUECOL(base.bg)) {
+	if (IS_TRUECOL(basebg)) {
 		colbg.alpha = 0xffff;
-		colbg.green = TRUEGREEN(base.bg);
-		colbg.red = TRUERED(base.bg);
-		colbg.blue = TRUEBLUE(base.bg);
+		colbg.green = TRUEGREEN(basebg);
+		colbg.red = TRUERED(basebg);
+		colbg.blue = TRUEBLUE(basebg);
 		XftColorAllocValue(xw.dpy, xw.vis, xw.cmap, &colbg, &truebg);
 		bg = &truebg;
 	} else {
-		bg = &dc.col[base.bg];
+		bg = &dc.col[basebg];
 	}
 
 	/* Change basic system colors [0-7] to bright system colors [8-15] */
-	if ((base.mode & ATTR_BOLD_FAINT) == ATTR_BOLD && BETWEEN(base.fg, 0, 7))
-		fg = &dc.col[base.fg + 8];
+	if ((base.mode & ATTR_BOLD_FAINT) == ATTR_BOLD && BETWEEN(basefg, 0, 7))
+		fg = &dc.col[basefg + 8];
 
 	if (IS_SET(MODE_REVERSE)) {
 		if (fg == &dc.col[defaultfg]) {
@@ -1631,48 +2036,169 @@ xdrawglyphfontspecs(const XftGlyphFontSpec *specs, Glyph base, int len, int x, i
 
 	/* Intelligent cleaning up of the borders. */
 	if (x == 0) {
-		xclear(0, (y == 0)? 0 : winy, borderpx,
+		xqueueclear(0, (y == 0)? 0 : winy, borderpx,
 			winy + win.ch +
 			((winy + win.ch >= borderpx + win.th)? win.h : 0));
 	}
 	if (winx + width >= borderpx + win.tw) {
-		xclear(winx + width, (y == 0)? 0 : winy, win.w,
+		xqueueclear(winx + width, (y == 0)? 0 : winy, win.w,
 			((winy + win.ch >= borderpx + win.th)? win.h : (winy + win.ch)));
 	}
 	if (y == 0)
-		xclear(winx, 0, winx + width, borderpx);
+		xqueueclear(winx, 0, winx + width, borderpx);
 	if (winy + win.ch >= borderpx + win.th)
-		xclear(winx, winy + win.ch, winx + width, win.h);
+		xqueueclear(winx, winy + win.ch, winx + width, win.h);
 
 	/* Clean up the region we want to draw to. */
-	XftDrawRect(xw.draw, bg, winx, winy, width, win.ch);
+	xqueuefill(bg, winx, winy, width, win.ch);
+
+	/* The glyphs follow once all backgrounds are down. */
+	if (batch.nruns == batch.runscap) {
+		batch.runscap = MAX(2 * batch.runscap, 64);
+		batch.runs = xrealloc(batch.runs, batch.runscap * sizeof(Run));
+		batch.clips = xrealloc(batch.clips,
+		                       batch.runscap * sizeof(XRectangle));
+	}
+	if (batch.nspecs + len > batch.specscap) {
+		batch.specscap = MAX(2 * batch.specscap, batch.nspecs + len);
+		batch.specs = xrealloc(batch.specs,
+		                       batch.specscap * sizeof(XftGlyphFontSpec));
+		batch.scratch = xrealloc(batch.scratch,
+		                         batch.specscap * sizeof(XftGlyphFontSpec));
+	}
+	run = &batch.runs[batch.nruns++];
+	run->fg = *fg;
+	run->bg = *bg;
+	run->y = y;
+	run->winx = winx;
+	run->width = width;
+	run->spec = batch.nspecs;
+	run->len = len;
+	run->mode = base.mode;
+	memcpy(batch.specs + batch.nspecs, specs, len * sizeof(*specs));
+	batch.nspecs += len;
+}
 
-	/* Set the clip region because Xft is sometimes dirty. */
-	r.x = 0;
-	r.y = 0;
-	r.height = win.ch;
-	r.width = width;
-	XftDrawSetClipRectangles(xw.draw, winx, winy, &r, 1);
+void
+xqueuefill(const XftColor *color, int x, int y, int w, int h)
+{
+	Fill *f;
 
-	if (base.mode & ATTR_BOXDRAW) {
-		drawboxes(winx, winy, width / len, win.ch, fg, bg, specs, len);
-	} else {
-		/* Render the glyphs. */
-		XftDrawGlyphFontSpec(xw.draw, fg, specs, len);
+	if (batch.nfills == batch.fillscap) {
+		batch.fillscap = MAX(2 * batch.fillscap, 64);
+		batch.fills = xrealloc(batch.fills, batch.fillscap * sizeof(Fill));
+		batch.rects = xrealloc(batch.rects,
+		                       batch.fillscap * sizeof(XRectangle));
 	}
+	f = &batch.fills[batch.nfills++];
+	f->color = *color;
+	f->r.x = x;
+	f->r.y = y;
+	f->r.width = w;
+	f->r.height = h;
+}
 
-	/* Render underline and strikethrough. */
-	if (base.mode & ATTR_UNDERLINE) {
-		XftDrawRect(xw.draw, fg, winx, winy + dc.font.ascent + 1, width, 1);
+void
+xqueueclear(int x1, int y1, int x2, int y2)
+{
+	xqueuefill(&dc.col[IS_SET(MODE_REVERSE)? defaultfg : defaultbg],
+			x1, y1, x2 - x1, y2 - y1);
+}
+
+/*
+ * Draws what xdrawglyphfontspecs() queued: first the backgrounds, one
+ * request per colour for all of them, then the glyphs line by line, one
+ * request per colour. Xft glyphs may stick out of their cells, so each
+ * request is clipped to the runs it draws, not to be painted over the
+ * background of the next.
+ */
+void
+xflushruns(void)
+{
+	Picture pict;
+	XRenderColor color;
+	XRectangle *clip;
+	Run *run, *end, *r;
+	int i, j, n, nclip, winy;
+
+	pict = XftDrawPicture(xw.draw);
+	for (i = 0; i < batch.nfills; i++) {
+		if (!batch.fills[i].r.width || !batch.fills[i].r.height)
+			continue;
+		if (!pict) {
+			XftDrawRect(xw.draw, &batch.fills[i].color,
+			            batch.fills[i].r.x, batch.fills[i].r.y,
+			            batch.fills[i].r.width, batch.fills[i].r.height);
+			continue;
+		}
+		color = batch.fills[i].color.color;
+		for (n = 0, j = i; j < batch.nfills; j++) {
+			if (memcmp(&batch.fills[j].color.color, &color,
+			           sizeof(color)))
+				continue;
+			batch.rects[n++] = batch.fills[j].r;
+			batch.fills[j].r.width = 0;
+		}
+		XRenderFillRectangles(xw.dpy, PictOpSrc, pict, &color,
+		                      batch.rects, n);
 	}
 
-	if (base.mode & ATTR_STRUCK) {
-		XftDrawRect(xw.draw, fg, winx, winy + 2 * dc.font.ascent * chscale / 3,
-				width, 1);
+	for (run = batch.runs; run < batch.runs + batch.nruns; run = end) {
+		for (end = run; end < batch.runs + batch.nruns &&
+		     end->y == run->y; end++)
+			end->done = 0;
+
+		winy = borderpx + run->y * win.ch;
+		for (r = run; r < end; r++) {
+			if (r->done || !r->len)
+				continue;
+			if (r->mode & ATTR_BOXDRAW) {
+				XftDrawSetClip(xw.draw, 0);
+				drawboxes(r->winx, winy, r->width / r->len,
+				          win.ch, &r->fg, &r->bg,
+				          batch.specs + r->spec, r->len);
+				continue;
+			}
+			color = r->fg.color;
+			for (n = nclip = 0, i = r - batch.runs;
+			     i < end - batch.runs; i++) {
+				if (batch.runs[i].done ||
+				    (batch.runs[i].mode & ATTR_BOXDRAW) ||
+				    memcmp(&batch.runs[i].fg.color, &color,
+				           sizeof(color)))
+					continue;
+				memcpy(batch.scratch + n,
+				       batch.specs + batch.runs[i].spec,
+				       batch.runs[i].len * sizeof(XftGlyphFontSpec));
+				n += batch.runs[i].len;
+				batch.runs[i].done = 1;
+				clip = &batch.clips[nclip++];
+				clip->x = batch.runs[i].winx;
+				clip->y = 0;
+				clip->width = batch.runs[i].width;
+				clip->height = win.ch;
+			}
+			XftDrawSetClipRectangles(xw.draw, 0, winy, batch.clips,
+			                         nclip);
+			XftDrawGlyphFontSpec(xw.draw, &r->fg, batch.scratch, n);
+		}
+
+		/* Render underline and strikethrough, inside their runs. */
+		XftDrawSetClip(xw.draw, 0);
+		for (r = run; r < end; r++) {
+			if (r->mode & ATTR_UNDERLINE) {
+				XftDrawRect(xw.draw, &r->fg, r->winx,
+				            winy + dc.font.ascent + 1, r->width, 1);
+			}
+			if (r->mode & ATTR_STRUCK) {
+				XftDrawRect(xw.draw, &r->fg, r->winx,
+				            winy + 2 * dc.font.ascent * chscale / 3,
+				            r->width, 1);
+			}
+		}
 	}
 
-	/* Reset clip to none. */
-	XftDrawSetClip(xw.draw, 0);
+	batch.nfills = batch.nruns = batch.nspecs = 0;
 }
 
 void
@@ -1690,6 +2216,10 @@ xdrawcursor(int cx, int cy, Glyph g, int ox, int oy, Glyph og, Line line, int le
 {
 	Color drawcol;
 
+	/* the lines drawn so far go below the cursor */
+	xflushruns();
+	xdamage(cy, cy);
+
 	/* remove the old cursor */
 	if (selected(ox, oy))
 		og.mode ^= ATTR_REVERSE;
@@ -1697,6 +2227,7 @@ xdrawcursor(int cx, int cy, Glyph g, int ox, int oy, Glyph og, Line line, int le
 	/* Redraw the line where cursor was previously.
 	 * It will restore the ligatures broken by the cursor. */
 	xdrawline(line, 0, oy, len);
+	xflushruns();
 
 	if (IS_SET(MODE_HIDE))
 		return;
@@ -1708,23 +2239,21 @@ xdrawcursor(int cx, int cy, Glyph g, int ox, int oy, Glyph og, Line line, int le
 
 	if (IS_SET(MODE_REVERSE)) {
 		g.mode |= ATTR_REVERSE;
-		g.bg = defaultfg;
 		if (selected(cx, cy)) {
 			drawcol = dc.col[defaultcs];
-			g.fg = defaultrcs;
+			g.col = tcolpair(defaultrcs, defaultfg);
 		} else {
 			drawcol = dc.col[defaultrcs];
-			g.fg = defaultcs;
+			g.col = tcolpair(defaultcs, defaultfg);
 		}
 	} else {
 		if (selected(cx, cy)) {
-			g.fg = defaultfg;
-			g.bg = defaultrcs;
+			g.col = tcolpair(defaultfg, defaultrcs);
+			drawcol = dc.col[defaultrcs];
 		} else {
-			g.fg = defaultbg;
-			g.bg = defaultcs;
+			g.col = tcolpair(defaultbg, defaultcs);
+			drawcol = dc.col[defaultcs];
 		}
-		drawcol = dc.col[g.bg];
 	}
 
 	/* draw the new one */
@@ -1737,6 +2266,7 @@ xdrawcursor(int cx, int cy, Glyph g, int ox, int oy, Glyph og, Line line, int le
 		case 1: /* Blinking Block (Default) */
 		case 2: /* Steady Block */
 			xdrawglyph(g, cx, cy);
+			xflushruns();
 			break;
 		case 3: /* Blinking Underline */
 		case 4: /* Steady Underline */
@@ -1774,6 +2304,20 @@ xdrawcursor(int cx, int cy, Glyph g, int ox, int oy, Glyph og, Line line, int le
 	}
 }
 
+/*
+ * The windows of other clients, which selwatch() and the INCR transfers
+ * use, can be gone by the time the server sees our request.
+ */
+int
+xerror(Display *dpy, XErrorEvent *ee)
+{
+	if (ee->error_code == BadWindow &&
+	    (ee->request_code == X_ChangeWindowAttributes ||
+	     ee->request_code == X_ChangeProperty))
+		return 0;
+	return xerrorxlib(dpy, ee);
+}
+
 void
 xsetenv(void)
 {
@@ -1814,23 +2358,27 @@ xsettitle(char *p)
 int
 xstartdraw(void)
 {
+	if (stats.show || stats.fp)
+		clock_gettime(CLOCK_MONOTONIC, &stats.start);
 	return IS_SET(MODE_VISIBLE);
 }
 
 void
 xdrawline(Line line, int x1, int y1, int x2)
 {
-	int i, x, ox, numspecs;
+	int i, x, ox, numspecs, s1, s2;
 	Glyph base, new;
 	XftGlyphFontSpec *specs = xw.specbuf;
 
+	stats.lines++;
+	selspan(y1, &s1, &s2);
 	numspecs = xmakeglyphfontspecs(specs, &line[x1], x2 - x1, x1, y1);
 	i = ox = 0;
 	for (x = x1; x < x2 && i < numspecs; x++) {
 		new = line[x];
 		if (new.mode == ATTR_WDUMMY)
 			continue;
-		if (selected(x, y1))
+		if (x >= s1 && x < s2)
 			new.mode ^= ATTR_REVERSE;
 		if (i > 0 && ATTRCMP(base, new)) {
 			xdrawglyphfontspecs(specs, base, i, ox, y1);
@@ -1851,11 +2399,345 @@ xdrawline(Line line, int x1, int y1, int x2)
 void
 xfinishdraw(void)
 {
-	XCopyArea(xw.dpy, xw.buf, xw.win, dc.gc, 0, 0, win.w,
-			win.h, 0, 0);
+	int i;
+
+	xflushruns();
+	/* the prompt is drawn again over a clean last line */
+	if (IS_SET(MODE_SEARCH))
+		xdamage(win.th / win.ch - 1, win.th / win.ch - 1);
+	/* and the hints over the URLs, which may have moved */
+	if (IS_SET(MODE_URLHINT)) {
+		for (i = 0; i < urlhint.n; i++)
+			xdamage(urlhint.cell[i][1], urlhint.cell[i][1]);
+		urlhint.n = turlhints(urlhint.cell, LEN(urlhint.cell));
+		for (i = 0; i < urlhint.n; i++)
+			xdamage(urlhint.cell[i][1], urlhint.cell[i][1]);
+	}
+	if (xw.ndamage < 0) {
+		XCopyArea(xw.dpy, xw.buf, xw.win, dc.gc, 0, 0, win.w,
+				win.h, 0, 0);
+	}
+	for (i = 0; i < xw.ndamage; i++) {
+		XCopyArea(xw.dpy, xw.buf, xw.win, dc.gc, 0, xw.damage[i].y,
+				win.w, xw.damage[i].height, 0, xw.damage[i].y);
+	}
+	xw.ndamage = 0;
+	if (IS_SET(MODE_SEARCH))
+		searchdraw();
+	if (IS_SET(MODE_URLHINT))
+		urlhintdraw();
 	XSetForeground(xw.dpy, dc.gc,
 			dc.col[IS_SET(MODE_REVERSE)?
 				defaultfg : defaultbg].pixel);
+	if (stats.show || stats.fp)
+		statsframe();
+}
+
+void
+statsreset(const struct timespec *now)
+{
+	stats.since = *now;
+	stats.frames = stats.lines = stats.nin = stats.nkey = 0;
+	stats.bytes = 0;
+	stats.drawms = stats.inms = stats.keyms = 0;
+}
+
+void
+statsinput(size_t n, const struct timespec *now)
+{
+	if (!n || !(stats.show || stats.fp))
+		return;
+	stats.bytes += n;
+	if (!stats.inputpending) {
+		stats.input = *now;
+		stats.inputpending = 1;
+	}
+	if (stats.keypending)
+		stats.keyechoed = 1;
+}
+
+void
+statskey(void)
+{
+	if (!(stats.show || stats.fp) || stats.keypending)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &stats.key);
+	stats.keypending = 1;
+	stats.keyechoed = 0;
+}
+
+/*
+ * Accounts for the frame just copied to the window: drawing time, and how
+ * long the input it shows has waited.
+ */
+void
+statsframe(void)
+{
+	struct timespec now;
+	char in[16], key[16];
+	double secs;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	stats.frames++;
+	stats.drawms += TIMEDIFF(now, stats.start);
+	if (stats.inputpending) {
+		stats.inms += TIMEDIFF(now, stats.input);
+		stats.nin++;
+		stats.inputpending = 0;
+	}
+	if (stats.keyechoed) {
+		stats.keyms += TIMEDIFF(now, stats.key);
+		stats.nkey++;
+		stats.keypending = stats.keyechoed = 0;
+	}
+
+	if ((secs = TIMEDIFF(now, stats.since) / 1E3) >= 1) {
+		snprintf(in, sizeof(in), stats.nin ? "%.1fms" : "-",
+		         stats.inms / MAX(stats.nin, 1));
+		snprintf(key, sizeof(key), stats.nkey ? "%.1fms" : "-",
+		         stats.keyms / MAX(stats.nkey, 1));
+		snprintf(stats.text, sizeof(stats.text),
+		         "%.0f fps  draw %.2fms  pty %s  key %s  "
+		         "%zu bytes %d lines/frame",
+		         stats.frames / secs, stats.drawms / stats.frames,
+		         in, key, stats.bytes / stats.frames,
+		         stats.lines / stats.frames);
+		if (stats.fp) {
+			fprintf(stats.fp, "%s\n", stats.text);
+			fflush(stats.fp);
+		}
+		statsreset(&now);
+	}
+
+	if (stats.show)
+		statsdraw();
+}
+
+void
+statsdraw(void)
+{
+	XGlyphInfo ext;
+	int len = strlen(stats.text), x;
+
+	XftTextExtentsUtf8(xw.dpy, dc.font.match, (FcChar8 *)stats.text,
+	                   len, &ext);
+	x = MAX(win.w - borderpx - ext.xOff, 0);
+	/* a narrower summary does not cover the left of the last one */
+	if (x > stats.x) {
+		XCopyArea(xw.dpy, xw.buf, xw.win, dc.gc, stats.x, borderpx,
+		          x - stats.x, win.ch, stats.x, borderpx);
+	}
+	stats.x = x;
+	XftDrawRect(xw.overlay, &dc.col[defaultfg], x, borderpx, ext.xOff,
+	            win.ch);
+	XftDrawStringUtf8(xw.overlay, &dc.col[defaultbg], dc.font.match, x,
+	                  borderpx + dc.font.ascent, (FcChar8 *)stats.text,
+	                  len);
+}
+
+/*
+ * Edits the query and moves between matches: Up or Ctrl-r goes to older
+ * ones, Down or Ctrl-s to newer ones. Return leaves the match selected
+ * and the view where it is, Escape goes back to the bottom.
+ */
+void
+searchkey(KeySym ksym, uint state, const char *buf, int len)
+{
+	Arg a;
+
+	switch (ksym) {
+	case XK_Escape:
+		selclear();
+		a.i = INT_MAX;
+		kscrolldown(&a);
+		win.mode &= ~MODE_SEARCH;
+		redraw();
+		return;
+	case XK_Return:
+	case XK_KP_Enter:
+		if (search.len > 0 && search.found)
+			setsel(getsel(), CurrentTime);
+		win.mode &= ~MODE_SEARCH;
+		redraw();
+		return;
+	case XK_BackSpace:
+		while (search.len > 0 &&
+		       (search.q[--search.len] & 0xc0) == 0x80)
+			;
+		search.q[search.len] = '\0';
+		search.found = tsearch(search.q, 0);
+		return;
+	case XK_Up:
+		search.found = tsearch(search.q, 1);
+		return;
+	case XK_Down:
+		search.found = tsearch(search.q, -1);
+		return;
+	}
+
+	if (state & ControlMask) {
+		if (ksym == XK_r)
+			search.found = tsearch(search.q, 1);
+		else if (ksym == XK_s)
+			search.found = tsearch(search.q, -1);
+		return;
+	}
+	if (len == 0 || (uchar)buf[0] < 0x20 || buf[0] == 0x7f ||
+	    search.len + len >= sizeof(search.q))
+		return;
+
+	memcpy(search.q + search.len, buf, len);
+	search.len += len;
+	search.q[search.len] = '\0';
+	search.found = tsearch(search.q, 0);
+}
+
+void
+searchdraw(void)
+{
+	char text[sizeof(search.q) + 32];
+	int len, y = borderpx + win.th - win.ch;
+
+	len = snprintf(text, sizeof(text), "search: %s%s", search.q,
+	               search.found ? "" : "  (not found)");
+	XftDrawRect(xw.overlay, &dc.col[defaultfg], 0, y, win.w, win.ch);
+	XftDrawStringUtf8(xw.overlay, &dc.col[defaultbg], dc.font.match,
+	                  borderpx, y + dc.font.ascent, (FcChar8 *)text, len);
+}
+
+/*
+ * Opens or copies the URL whose hint letter was typed; any other key
+ * leaves the hints.
+ */
+void
+urlhintkey(KeySym ksym, const char *buf, int len)
+{
+	Atom clipboard;
+	char *url, *old;
+	int i;
+
+	win.mode &= ~MODE_URLHINT;
+	redraw();
+
+	if (len != 1 || !BETWEEN(buf[0], 'a', 'a' + urlhint.n - 1))
+		return;
+	i = buf[0] - 'a';
+	if (!(url = turlget(urlhint.cell[i][0], urlhint.cell[i][1])))
+		return;
+
+	if (urlhint.copy) {
+		old = xsel.clipboard;
+		xsel.clipboard = url;
+		selfree(old);
+		clipboard = XInternAtom(xw.dpy, "CLIPBOARD", 0);
+		XSetSelectionOwner(xw.dpy, clipboard, xw.win, CurrentTime);
+	} else {
+		urlopen(url);
+		free(url);
+	}
+}
+
+void
+urlhintdraw(void)
+{
+	char label;
+	int i, x, y;
+
+	for (i = 0; i < urlhint.n; i++) {
+		label = 'a' + i;
+		x = borderpx + urlhint.cell[i][0] * win.cw;
+		y = borderpx + urlhint.cell[i][1] * win.ch;
+		XftDrawRect(xw.overlay, &dc.col[defaultfg], x, y, win.cw,
+		            win.ch);
+		XftDrawStringUtf8(xw.overlay, &dc.col[defaultbg],
+		                  dc.font.match, x, y + dc.font.ascent,
+		                  (FcChar8 *)&label, 1);
+	}
+}
+
+/*
+ * Runs urlopencmd with the URL appended, detached from st: the child in
+ * between exits right away, so nothing is left to reap.
+ */
+void
+urlopen(char *url)
+{
+	char *argv[LEN(urlopencmd) + 1];
+	pid_t pid;
+	int i;
+
+	for (i = 0; urlopencmd[i]; i++)
+		argv[i] = urlopencmd[i];
+	argv[i++] = url;
+	argv[i] = NULL;
+
+	switch ((pid = fork())) {
+	case -1:
+		fprintf(stderr, "fork failed: %s\n", strerror(errno));
+		return;
+	case 0:
+		setsid();
+		if (fork() == 0) {
+			execvp(argv[0], argv);
+			fprintf(stderr, "st: execvp %s: %s\n", argv[0],
+			        strerror(errno));
+		}
+		_exit(0);
+	}
+	waitpid(pid, NULL, 0);
+}
+
+/*
+ * Notes rows y1 to y2 of the drawing buffer, with the borders next to
+ * them, as changed; xfinishdraw() only copies these bands to the window.
+ * Rows usually come top to bottom, so touching bands are merged.
+ */
+void
+xdamage(int y1, int y2)
+{
+	XRectangle *r;
+	int top, bot;
+
+	if (xw.ndamage < 0)
+		return;
+
+	top = (y1 == 0) ? 0 : borderpx + y1 * win.ch;
+	bot = ((y2 + 1) * win.ch >= win.th) ? win.h : borderpx + (y2 + 1) * win.ch;
+
+	if (xw.ndamage > 0) {
+		r = &xw.damage[xw.ndamage - 1];
+		if (top <= r->y + r->height && bot >= r->y) {
+			bot = MAX(bot, r->y + r->height);
+			r->y = MIN(top, r->y);
+			r->height = bot - r->y;
+			return;
+		}
+	}
+	if (xw.ndamage == LEN(xw.damage)) {
+		xw.ndamage = -1;
+		return;
+	}
+	r = &xw.damage[xw.ndamage++];
+	r->y = top;
+	r->height = bot - top;
+}
+
+/*
+ * Moves rows top to bot of the drawing buffer up by n rows, down for
+ * n < 0. The rows left behind are drawn again by the caller.
+ */
+void
+xscroll(int top, int bot, int n)
+{
+	int h = (bot - top + 1 - abs(n)) * win.ch;
+
+	if (h <= 0)
+		return;
+	xflushruns();
+	xdamage(top, bot);
+	XCopyArea(xw.dpy, xw.buf, xw.buf, dc.gc,
+			0, borderpx + (top + MAX(n, 0)) * win.ch, win.w, h,
+			0, borderpx + (top - MIN(n, 0)) * win.ch);
 }
 
 void
@@ -1873,6 +2755,7 @@ xximspot(int x, int y)
 void
 expose(XEvent *ev)
 {
+	xw.ndamage = -1;
 	redraw();
 }
 
@@ -2048,6 +2931,16 @@ reallocbuf:
 		// so it is not as critical
 		len = XLookupString(e, buf, buf_size, &ksym, NULL);
 	}
+	/* 0. the search prompt and URL hints take all keys */
+	if (IS_SET(MODE_SEARCH)) {
+		searchkey(ksym, e->state, buf, len);
+		goto cleanup;
+	}
+	if (IS_SET(MODE_URLHINT)) {
+		urlhintkey(ksym, buf, len);
+		goto cleanup;
+	}
+
 	/* 1. shortcuts */
 	for (bp = shortcuts; bp < shortcuts + LEN(shortcuts); bp++) {
 		if (ksym == bp->keysym && match(bp->mod, e->state)) {
@@ -2058,6 +2951,7 @@ reallocbuf:
 
 	/* 2. custom keys from config.h */
 	if ((customkey = kmap(ksym, e->state))) {
+		statskey();
 		ttywrite(customkey, strlen(customkey), 1);
 		goto cleanup;
 	}
@@ -2077,8 +2971,10 @@ reallocbuf:
 			len = 2;
 		}
 	}
-	if (len <= buf_size)
+	if (len <= buf_size) {
+		statskey();
 		ttywrite(buf, len, 1);
+	}
 cleanup:
 	if (buf)
 		free(buf);
@@ -2118,9 +3014,9 @@ run(void)
 {
 	XEvent ev;
 	int w = win.w, h = win.h;
-	fd_set rfd;
-	int xfd = XConnectionNumber(xw.dpy), ttyfd, xev, drawing;
-	struct timespec seltv, *tv, now, lastblink, trigger;
+	fd_set rfd, wfd;
+	int xfd = XConnectionNumber(xw.dpy), ttyfd, wttyfd, xev, drawing;
+	struct timespec seltv, *tv, now, lastblink, trigger, lastdraw;
 	double timeout;
 
 	/* Waiting for window mapping */
@@ -2139,13 +3035,21 @@ run(void)
 		}
 	} while (ev.type != MapNotify);
 
+	if (opt_trace)
+		traceopen(opt_trace, opt_tracemode);
 	ttyfd = ttynew(opt_line, shell, opt_io, opt_cmd);
 	cresize(w, h);
 
+	clock_gettime(CLOCK_MONOTONIC, &lastdraw);
+	statsreset(&lastdraw);
 	for (timeout = -1, drawing = 0, lastblink = (struct timespec){0};;) {
 		FD_ZERO(&rfd);
+		FD_ZERO(&wfd);
 		FD_SET(ttyfd, &rfd);
 		FD_SET(xfd, &rfd);
+		/* pty output queued up by a paste */
+		if ((wttyfd = ttywritefd()) >= 0)
+			FD_SET(wttyfd, &wfd);
 
 		if (XPending(xw.dpy))
 			timeout = 0;  /* existing events might not set xfd */
@@ -2154,15 +3058,18 @@ run(void)
 		seltv.tv_nsec = 1E6 * (timeout - 1E3 * seltv.tv_sec);
 		tv = timeout >= 0 ? &seltv : NULL;
 
-		if (pselect(MAX(xfd, ttyfd)+1, &rfd, NULL, NULL, tv, NULL) < 0) {
+		if (pselect(MAX(MAX(xfd, ttyfd), wttyfd)+1, &rfd, &wfd, NULL, tv,
+		            NULL) < 0) {
 			if (errno == EINTR)
 				continue;
 			die("select failed: %s\n", strerror(errno));
 		}
 		clock_gettime(CLOCK_MONOTONIC, &now);
 
+		if (wttyfd >= 0 && FD_ISSET(wttyfd, &wfd))
+			ttyflush();
 		if (FD_ISSET(ttyfd, &rfd))
-			ttyread();
+			statsinput(ttyread(), &now);
 
 		xev = 0;
 		while (XPending(xw.dpy)) {
@@ -2194,6 +3101,19 @@ run(void)
 			          / maxlatency * minlatency;
 			if (timeout > 0)
 				continue;  /* we have time, try to find idle */
+
+			/*
+			 * During a flood, a frame whose content already
+			 * scrolled away is not worth drawing: keep parsing
+			 * until idle or floodlatency, unless the user did
+			 * something.
+			 */
+			if (!xev && tscrolled() > 0 &&
+			    TIMEDIFF(now, lastdraw) < floodlatency) {
+				timeout = MIN(minlatency,
+				              floodlatency - TIMEDIFF(now, lastdraw));
+				continue;
+			}
 		}
 
 		/* idle detected or maxlatency exhausted -> draw */
@@ -2213,6 +3133,7 @@ run(void)
 		draw();
 		XFlush(xw.dpy);
 		drawing = 0;
+		lastdraw = now;
 	}
 }
 
@@ -2272,12 +3193,16 @@ usage(void)
 {
 	die("usage: %s [-aiv] [-c class] [-f font] [-g geometry]"
 	    " [-n name] [-o file]\n"
-	    "          [-T title] [-t title] [-w windowid]"
+	    "          [-T title] [-t title] [-w windowid] [-r trace]"
 	    " [[-e] command [args ...]]\n"
 	    "       %s [-aiv] [-c class] [-f font] [-g geometry]"
 	    " [-n name] [-o file]\n"
-	    "          [-T title] [-t title] [-w windowid] -l line"
-	    " [stty_args ...]\n", argv0, argv0);
+	    "          [-T title] [-t title] [-w windowid] [-r trace] -l line"
+	    " [stty_args ...]\n"
+	    "       %s [-aiv] [-c class] [-f font] [-g geometry]"
+	    " [-n name]\n"
+	    "          [-T title] [-t title] [-w windowid] -p|-P trace\n",
+	    argv0, argv0, argv0);
 }
 
 int
@@ -2320,6 +3245,15 @@ main(int argc, char *argv[])
 	case 'n':
 		opt_name = EARGF(usage());
 		break;
+	case 'p':
+	case 'P':
+		opt_tracemode = (ARGC() == 'p') ? TRACE_REPLAY : TRACE_REPLAYFAST;
+		opt_trace = EARGF(usage());
+		break;
+	case 'r':
+		opt_tracemode = TRACE_RECORD;
+		opt_trace = EARGF(usage());
+		break;
 	case 't':
 	case 'T':
 		opt_title = EARGF(usage());
@@ -2346,6 +3280,7 @@ run:
 
 	if(!(xw.dpy = XOpenDisplay(NULL)))
 		die("Can't open display\n");
+	xerrorxlib = XSetErrorHandler(xerror);
 
 	config_init();
 	cols = MAX(cols, 1);
@@ -2354,6 +3289,8 @@ run:
 	alphaUnfocus = alpha-alphaOffset;
 	tnew(cols, rows);
 	xinit(cols, rows);
+	if (getenv("ST_STATS") && !(stats.fp = fopen(getenv("ST_STATS"), "a")))
+		fprintf(stderr, "can't open $ST_STATS: %s\n", strerror(errno));
 	xsetenv();
 	selinit();
 	run();